@@ -0,0 +1,160 @@
+#!/bin/bash
+# Runs every sample program RUNS times on each of ENGINES, checks its
+# output against bench.sums and writes the timings to OUTPUT as JSON.
+#
+#   ./bench.sh [--update-sums] [programs..]
+#
+# --update-sums records the interpreter output of the programs as the
+# expected one. The environment may override
+#   BFVM     the binary to benchmark        (./bfvm)
+#   RUNS     runs per program and engine    (5)
+#   ENGINES  engines to run                 (interpreter threaded switch
+#                                            compact jit aot)
+#   OUTPUT   where the JSON goes            (bench.json)
+#   COMPILE_JOBS  --jobs to time the compile of the sources parsed on
+#                 several threads with          (1 2 4 8)
+
+BFVM=${BFVM:-./bfvm}
+RUNS=${RUNS:-5}
+ENGINES=${ENGINES:-interpreter threaded switch compact jit aot}
+OUTPUT=${OUTPUT:-bench.json}
+COMPILE_JOBS=${COMPILE_JOBS:-1 2 4 8}
+# the size from which bfvm parses a source on several threads
+PARALLEL_MIN=1048576
+SUMS=bench.sums
+# these never halt
+ENDLESS="e.b golden.b impeccable.b"
+
+update=false
+if [ "$1" = "--update-sums" ]; then
+	update=true
+	shift
+fi
+
+programs="$*"
+if [ -z "$programs" ]; then
+	for program in *.b *.bf; do
+		case " $ENDLESS " in
+			*" $program "*) ;;
+			*) programs="$programs $program" ;;
+		esac
+	done
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# runs program with the given options, leaving the output in $tmp/out
+# and the report line in $tmp/report
+run() {
+	local program=$1
+	shift
+	local input=
+	[ -f "$program.in" ] && input=$program.in
+	"$BFVM" --report "$@" "$program" $input > "$tmp/out" 2> "$tmp/err"
+	local status=$?
+	grep '^{"compile"' "$tmp/err" | tail -n 1 > "$tmp/report"
+	return $status
+}
+
+checksum() {
+	cksum < "$tmp/out" | awk '{ print $1, $2 }'
+}
+
+field() {
+	sed -e "s/.*\"$1\": \([0-9.]*\).*/\1/" "$tmp/report"
+}
+
+# median, min, mean and standard deviation of the numbers on stdin
+stats() {
+	sort -g | awk '{ v[NR] = $1; sum += $1 }
+	END {
+		mean = sum / NR
+		for(i = 1; i <= NR; i++) dev += (v[i] - mean) ^ 2
+		median = NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+		printf "{\"median\": %f, \"min\": %f, \"mean\": %f, \"stddev\": %f}",
+		       median, v[1], mean, sqrt(dev / NR)
+	}'
+}
+
+if $update; then
+	for program in $programs; do
+		run "$program" || echo "$program: exited with $?" >&2
+		grep -v " $program\$" "$SUMS" 2> /dev/null > "$tmp/sums"
+		echo "$(checksum) $program" >> "$tmp/sums"
+		sort -k 3 "$tmp/sums" > "$SUMS"
+		echo "$program: $(checksum)"
+	done
+	exit 0
+fi
+
+failed=0
+first=true
+echo "{\"runs\": $RUNS, \"results\": [" > "$OUTPUT"
+for program in $programs; do
+	expected=$(awk -v p="$program" '$3 == p { print $1, $2 }' "$SUMS")
+	# the instruction count is the same for every engine
+	run "$program" --count-ops
+	ops=$(field ops)
+	for engine in $ENGINES; do
+		ok=true
+		: > "$tmp/compile"
+		: > "$tmp/cpu"
+		: > "$tmp/wall"
+		for ((i = 0; i < RUNS; i++)); do
+			if ! run "$program" --engine=$engine ||
+			   [ "$(checksum)" != "$expected" ]; then
+				ok=false
+			fi
+			field compile >> "$tmp/compile"
+			field cpu >> "$tmp/cpu"
+			field wall >> "$tmp/wall"
+		done
+		$ok || failed=$((failed + 1))
+		wall=$(stats < "$tmp/wall")
+		median=$(echo "$wall" | sed -e 's/.*"median": \([0-9.]*\).*/\1/')
+		opsPerSec=$(awk -v o="$ops" -v t="$median" \
+		            'BEGIN { printf "%.0f", (t > 0 ? o / t : 0) }')
+		$first || echo "," >> "$OUTPUT"
+		first=false
+		printf '  {"program": "%s", "engine": "%s", "ok": %s, "ops": %s, ' \
+		       "$program" "$engine" "$ok" "$ops" >> "$OUTPUT"
+		printf '"ops_per_sec": %s,\n   "compile": %s,\n' \
+		       "$opsPerSec" "$(stats < "$tmp/compile")" >> "$OUTPUT"
+		printf '   "wall": %s,\n   "cpu": %s}' \
+		       "$wall" "$(stats < "$tmp/cpu")" >> "$OUTPUT"
+		printf '%-16s %-12s %-5s wall %ss  %s ops/s\n' \
+		       "$program" "$engine" "$($ok && echo ok || echo WRONG)" \
+		       "$median" "$opsPerSec"
+	done
+done
+echo "" >> "$OUTPUT"
+
+# how the compile time of the large sources scales with the threads
+echo "], \"compile_scaling\": [" >> "$OUTPUT"
+first=true
+for program in $programs; do
+	[ "$(stat -c %s "$program")" -ge $PARALLEL_MIN ] || continue
+	for jobs in $COMPILE_JOBS; do
+		: > "$tmp/compile"
+		for ((i = 0; i < RUNS; i++)); do
+			run "$program" --no-cache --jobs=$jobs
+			field compile >> "$tmp/compile"
+		done
+		compile=$(stats < "$tmp/compile")
+		median=$(echo "$compile" | sed -e 's/.*"median": \([0-9.]*\).*/\1/')
+		$first || echo "," >> "$OUTPUT"
+		first=false
+		printf '  {"program": "%s", "jobs": %s, "compile": %s}' \
+		       "$program" "$jobs" "$compile" >> "$OUTPUT"
+		printf '%-16s compile with %-3s jobs %ss\n' \
+		       "$program" "$jobs" "$median"
+	done
+done
+echo "" >> "$OUTPUT"
+echo "]}" >> "$OUTPUT"
+
+if [ $failed -ne 0 ]; then
+	echo "$failed program and engine pairs produced wrong output!" >&2
+	exit 1
+fi
@@ -1,12 +1,57 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
-#define MAX_CELLS 65536
+#include "bfvm.h"
 
-char memory[MAX_CELLS];
+// cells accessible at the start, the tape grows on demand beyond that.
+// this is also the size of the tape of the transpiled C.
+#define TAPE_CELLS 65536
+
+// The cells are 8, 16 or 32 bits wide, and input leaves the cell
+// unchanged, stores 0 or stores -1 at the end of the input, as chosen
+// with --cell and --eof. The compiler wraps values around at the width,
+// and every engine is generated once for every combination, so the
+// running program never looks at either.
+enum { EOF_UNCHANGED, EOF_ZERO, EOF_MINUS_ONE, EOF_MODES };
+
+#define CELL_WIDTHS 3
+#define CELL_INDEX(bits) ((bits) / 16)
+
+const char *eofNames[] = {"unchanged", "0", "-1"};
+
+int cellBits = 8, eofMode = EOF_MINUS_ONE;
+
+unsigned cell_mask() {
+	return cellBits == 32 ? 0xFFFFFFFFu : (1u << cellBits) - 1;
+}
+
+// the value as a cell holds it, read as signed
+int cell_wrap(int value) {
+	int shift = 32 - cellBits;
+	return (int)((unsigned)value << shift) >> shift;
+}
 
 #define SPECIALIZED8(x) \
 	x##_1, x##_2, x##_3, x##_4, x##_5, x##_6, x##_7, x##_8, x##_X
@@ -19,10 +64,31 @@ enum {
 	SPECIALIZED8(RIGHT),
 	INPUT,
 	OUTPUT,
-	JMPZ,       // x
-	JMPNZ,      // x
-	RESET_CELL, // reset present cell's value to 0
+	JMPZ,        // x
+	JMPNZ,       // x
+	RESET_CELL,  // reset present cell's value to 0
+	ADD_AT,      // x y, add y to the cell at offset x
+	MUL_LOOP,    // n x [y z]*n, run a balanced copy/multiply loop in one go
+	SCAN_LEFT,   // x, move left by x until a zero cell is found
+	SCAN_RIGHT,  // x, move right by x until a zero cell is found
+	CLEAR_RANGE, // x n, reset the n cells from offset x to 0
+	ADD_RANGE,   // w n x [v]*w, add a window of n values to the cells from
+	             // offset x, packed as cells into w ints
+	MUL_RANGE,   // w n x y [v]*w, a MUL_LOOP adding x times the window to
+	             // the cells from offset y
 	END,
+// the fused instructions, with the operands of their parts in order
+#define SUPER(name, a, b, c) SUPER_##name,
+#include "superinstructions.h"
+#undef SUPER
+	OPCODE_COUNT
+};
+
+// the instructions every fused one does
+const int superParts[][3] = {
+#define SUPER(name, a, b, c) {a, b, c},
+#include "superinstructions.h"
+#undef SUPER
 };
 
 typedef struct {
@@ -30,12 +96,17 @@ typedef struct {
 	int value;
 } Change;
 
-#define ARRAY(type, name)                                                  \
-	typedef struct {                                                       \
-		type *values;                                                      \
-		int   size, capacity;                                              \
-	} name##Array;                                                         \
-                                                                           \
+#define ARRAY_TYPE(type, name) \
+	typedef struct {           \
+		type *values;          \
+		int   size, capacity;  \
+	} name##Array
+
+#define ARRAY(type, name)  \
+	ARRAY_TYPE(type, name); \
+	ARRAY_FUNCTIONS(type, name)
+
+#define ARRAY_FUNCTIONS(type, name)                                        \
 	void type##_array_init(name##Array *a) {                               \
 		a->capacity = a->size = 0;                                         \
 		a->values             = NULL;                                      \
@@ -63,628 +134,4350 @@ typedef struct {
 		a->values             = NULL;                                      \
 	}
 
+typedef unsigned char Byte;
+
 ARRAY(int, Int);
 ARRAY(Change, Change);
+ARRAY(Byte, Byte);
 
-bool skipAll(char **s) {
-	char *source  = *s;
-	bool  skipped = false;
-	while(*source) {
-		switch(*source) {
-			case '>':
-			case '<':
-			case '+':
-			case '-':
-			case '.':
-			case ',':
-			case '[':
-			case ']': *s = source; return skipped;
-			default:
-				source++;
-				skipped = true;
-				break;
-		}
-	}
-	*s = source;
+// nonzero for the eight characters that make up a program, so that
+// comments can be skipped with one load per byte
+const bool isCommand[256] = {['>'] = true, ['<'] = true, ['+'] = true,
+                             ['-'] = true, ['.'] = true, [','] = true,
+                             ['['] = true, [']'] = true};
+
+bool skipAll(const char **s, const char *end) {
+	const char *source = *s;
+	while(source < end && !isCommand[(unsigned char)*source]) source++;
+	bool skipped = source != *s;
+	*s           = source;
 	return skipped;
 }
 
-void check_repeat(char c, char **source, IntArray *program, int code_start) {
-	int   count = 0; // 0 based count, as c has already occurred
-	char *s     = *source;
-	while(*s == c || (skipAll(&s) && *s == c)) {
+// returns the number of consecutive occurrences of c, ignoring comments
+// in between, including the one that has already been consumed
+int check_repeat(char c, const char **source, const char *end) {
+	int         count = 1;
+	const char *s     = *source;
+	while(s < end && (*s == c || (skipAll(&s, end) && s < end && *s == c))) {
 		s++;
 		count++;
 	}
 	*source = s;
+	return count;
+}
+
+void insert_repeat(IntArray *program, int code_start, int count) {
 	switch(count) {
-		case 0:
 		case 1:
 		case 2:
 		case 3:
 		case 4:
 		case 5:
 		case 6:
-		case 7: int_array_insert(program, code_start + count); break;
+		case 7:
+		case 8: int_array_insert(program, code_start + count - 1); break;
 		default:
 			int_array_insert(program, code_start + 8);
-			int_array_insert(program, count + 1);
+			int_array_insert(program, count);
 			break;
 	}
 }
 
-IntArray *compile(char *source) {
-	IntArray *program = (IntArray *)malloc(sizeof(IntArray));
-	int_array_init(program);
-	IntArray jumpstack;
-	int_array_init(&jumpstack);
-	while(*source) {
-		switch(*source++) {
-			case '>': check_repeat('>', &source, program, RIGHT_1); break;
-			case '<': check_repeat('<', &source, program, LEFT_1); break;
-			case '+': check_repeat('+', &source, program, INCR_1); break;
-			case '-': check_repeat('-', &source, program, DECR_1); break;
-			case '.': int_array_insert(program, OUTPUT); break;
-			case ',': int_array_insert(program, INPUT); break;
-			case '[': {
-				char *bak = source;
-				skipAll(&bak);
-				if(*bak == '-' || *bak == '+') {
-					bak++;
-					skipAll(&bak);
-					if(*bak == ']') {
-						bak++;
-						source = bak;
-						int_array_insert(program, RESET_CELL);
-						break;
-					}
-				}
-				int_array_insert(program, JMPZ);
-				int_array_insert(program, 0);
-				int_array_insert(&jumpstack, program->size);
-				break;
-			}
-			case ']': {
-				if(jumpstack.size == 0) {
-					printf("Unmatched ']'!\n");
-					int_array_free(program);
-					int_array_free(&jumpstack);
-					return NULL;
-				}
-				int lastJump = jumpstack.values[--jumpstack.size];
-				int_array_insert(program, JMPNZ);
-				int_array_insert(program, lastJump - program->size - 1);
-				program->values[lastJump - 1] = program->size - lastJump;
-				break;
-			}
-			default: skipAll(&source); break;
+void apply_total_change(ChangeArray *ca, int currentPointer, int totalChange) {
+	for(int i = 0; i < ca->size; i++) {
+		if(ca->values[i].idx == currentPointer) {
+			ca->values[i].value += totalChange;
+			return;
 		}
 	}
-	if(jumpstack.size > 0) {
-		printf("Unmatched '['!\n");
-		int_array_free(program);
-		int_array_free(&jumpstack);
-		return NULL;
-	}
-	int_array_free(&jumpstack);
-	int_array_insert(program, END);
-	return program;
+	Change_array_insert(ca, (Change){currentPointer, totalChange});
 }
 
-#define SPECIALIZED8_SINGLE_LINE_DEBUG(name, num) \
-	case name##_##num:                            \
-		printf(#name "\t\t" #num);                \
-		break;
-#define SPECIALIZED8_LINE_X_DEBUG(name)           \
-	case name##_X:                                \
-		printf(#name "_X\t\t%d", *(program + 1)); \
-		return ip + 2;
-#define SPECIALIZED8_DEBUG(name)             \
-	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 1); \
-	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 2); \
-	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 3); \
-	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 4); \
-	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 5); \
-	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 6); \
-	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 7); \
-	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 8); \
-	SPECIALIZED8_LINE_X_DEBUG(name);
+// The profiler runs the program compiled without scans, which leaves the
+// loops that only move as real loops, counting how often each bytecode
+// address executes, so that the trip counts of the loops still in the
+// bytecode can be saved and used by later compiles. the other passes
+// run as usual, mul loops and dead loops never make it into a profile.
+typedef struct {
+	int      offset;     // of the '[' in the source
+	uint64_t entries;    // times the loop was reached
+	uint64_t iterations; // times its body ran
+} LoopProfile;
 
-int disassemble_single(int ip, int *program) {
-	printf("%6d: ", ip);
-	switch(*program) {
-		SPECIALIZED8_DEBUG(INCR);
-		SPECIALIZED8_DEBUG(DECR);
-		SPECIALIZED8_DEBUG(LEFT);
-		SPECIALIZED8_DEBUG(RIGHT);
-		case INPUT: printf("INPUT"); break;
-		case OUTPUT: printf("OUTPUT"); break;
-		case JMPZ: printf("JMPZ\t\t%d", *(program + 1)); return ip + 2;
-		case JMPNZ: printf("JMPNZ\t\t%d", *(program + 1)); return ip + 2;
-		case RESET_CELL: printf("RESET_CELL"); break;
-		case END: printf("END"); break;
-		case START: printf("START"); break;
+ARRAY(LoopProfile, LoopProfile);
+
+typedef struct {
+	bool             collect;   // compile for and run the profiling engine
+	IntArray         sourceMap; // source offset of every bytecode address
+	uint64_t *       counts;    // executions of every bytecode address
+	LoopProfileArray loops;     // a loaded profile, sorted by offset
+} Profile;
+
+Profile profile;
+
+// scans shorter than this run faster as plain loops than as a call
+#define SCAN_MIN_TRIPS 4
+
+// returns the profile of the loop starting at offset, if any
+LoopProfile *profile_find(int offset) {
+	int low = 0, high = profile.loops.size - 1;
+	while(low <= high) {
+		int mid = (low + high) / 2;
+		if(profile.loops.values[mid].offset == offset)
+			return &profile.loops.values[mid];
+		if(profile.loops.values[mid].offset < offset)
+			low = mid + 1;
+		else
+			high = mid - 1;
 	}
-	return ip + 1;
+	return NULL;
 }
 
-void disassemble_all(IntArray *pgm) {
-	int *program = pgm->values;
-	for(int i = 0; i < pgm->size;) {
-		i = disassemble_single(i, &program[i]);
-		printf("\n");
-	}
-	printf("\n");
+// whether the loop starting at offset should become a SCAN if it can
+bool scan_profitable(int offset) {
+	if(profile.collect)
+		return false;
+	LoopProfile *loop = profile_find(offset);
+	return loop == NULL || loop->entries == 0 ||
+	       loop->iterations >= loop->entries * SCAN_MIN_TRIPS;
 }
 
-#ifndef DEBUG
-#define BFVM_COMPUTED_GOTO
-#endif
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-#define next_code() (*(code++))
-#ifdef BFVM_COMPUTED_GOTO
-#define LOOP() while(1)
-#define SWITCH() \
-	{ goto *dispatchTable[next_code()]; }
-#define CASE(x) LABEL_##x
-#define DISPATCH() goto *dispatchTable[next_code()]
-#else
-#define LOOP() while(1)
-#define SWITCH() switch(next_code())
-#define CASE(x) case x
-#define DISPATCH() break
-#endif
+// The optimizer works on a tree built from the source. A block is a
+// list of nodes whose offsets are relative to the pointer at that node,
+// and loops hold their body as a nested block.
+enum {
+	IR_ADD,    // cell[offset] += value
+	IR_SET,    // cell[offset] = value
+	IR_MOVE,   // cell += value
+	IR_INPUT,  // cell[offset] = input
+	IR_OUTPUT, // output cell[offset]
+	IR_LOOP,   // while(cell[0]) body
+	IR_MUL,    // a loop that only adds, changing cell[0] by value. the
+	           // body holds the adds to the other cells
+	IR_SCAN,   // while(cell[0]) cell += value
+	IR_TOUCH,  // reads cell[offset], see pass_reach
+};
 
-#define SPECIALIZED8_SINGLE_INS(name, x, op, num) \
-	CASE(name##_##num) : {                        \
-		x op## = num;                             \
-		DISPATCH();                               \
+const char *irNames[] = {"add",  "set", "move", "input", "output",
+                         "loop", "mul", "scan", "touch"};
+
+typedef struct Node Node;
+
+ARRAY_TYPE(Node, Node);
+
+struct Node {
+	int       kind, offset, value;
+	int       source; // offset of the command in the source
+	NodeArray body;
+};
+
+ARRAY_FUNCTIONS(Node, Node);
+
+typedef NodeArray *Block;
+
+ARRAY(Block, Block);
+
+Node ir_node(int kind, int offset, int value, int source) {
+	Node node = {kind, offset, value, source, {NULL, 0, 0}};
+	return node;
+}
+
+void ir_free(NodeArray *block) {
+	for(int i = 0; i < block->size; i++) ir_free(&block->values[i].body);
+	Node_array_free(block);
+}
+
+// a copy of the node with a copy of its body
+Node ir_copy(const Node *node) {
+	Node copy = *node;
+	Node_array_init(&copy.body);
+	for(int i = 0; i < node->body.size; i++)
+		Node_array_insert(&copy.body, ir_copy(&node->body.values[i]));
+	return copy;
+}
+
+void ir_dump(NodeArray *block, int level) {
+	for(int i = 0; i < block->size; i++) {
+		Node *node = &block->values[i];
+		for(int l = 0; l < level; l++) fputc('\t', stderr);
+		fprintf(stderr, "%s", irNames[node->kind]);
+		switch(node->kind) {
+			case IR_ADD:
+			case IR_SET:
+				fprintf(stderr, " %d %d", node->offset, node->value);
+				break;
+			case IR_INPUT:
+			case IR_OUTPUT:
+			case IR_TOUCH: fprintf(stderr, " %d", node->offset); break;
+			case IR_MOVE:
+			case IR_MUL:
+			case IR_SCAN: fprintf(stderr, " %d", node->value); break;
+		}
+		if(node->kind == IR_LOOP || node->kind == IR_MUL)
+			fprintf(stderr, " @%d", node->source);
+		fputc('\n', stderr);
+		ir_dump(&node->body, level + 1);
 	}
-#define SPECIALIZED8_INS_X(name, x, op) \
-	CASE(name##_X) : {                  \
-		x op## = *code++;               \
-		DISPATCH();                     \
+}
+
+// The parse first turns the source into a list of tokens, runs of the
+// same command with their length, and then builds the tree from them.
+// Large sources are cut into chunks tokenized on threads of their own,
+// which also count the change in bracket depth over their chunk and the
+// lowest depth in it, so that the brackets are checked without looking
+// at the source again. A run cut in two is joined back before the tree
+// is built, so the tree is the same whatever the number of chunks.
+#define PARALLEL_PARSE_MIN (1 << 20)
+
+// threads tokenizing a source of at least PARALLEL_PARSE_MIN bytes
+int parseThreads = 1;
+
+typedef struct {
+	char command;
+	int  count, source;
+} Token;
+
+ARRAY(Token, Token);
+
+typedef struct {
+	const char *begin, *start, *end; // the source, and the chunk of it
+	TokenArray  tokens;
+	int         depth, lowest; // relative to the depth at the start
+	pthread_t   thread;
+} Chunk;
+
+void *tokenize(void *arg) {
+	Chunk *     chunk  = (Chunk *)arg;
+	const char *source = chunk->start, *end = chunk->end;
+	Token_array_init(&chunk->tokens);
+	chunk->depth = chunk->lowest = 0;
+	while(source < end) {
+		Token token = {*source, 1, source - chunk->begin};
+		switch(*source++) {
+			case '+':
+			case '-':
+			case '>':
+			case '<':
+				token.count = check_repeat(token.command, &source, end);
+				break;
+			case '[': chunk->depth++; break;
+			case ']':
+				if(--chunk->depth < chunk->lowest)
+					chunk->lowest = chunk->depth;
+				break;
+			case '.':
+			case ',': break;
+			default: skipAll(&source, end); continue;
+		}
+		Token_array_insert(&chunk->tokens, token);
 	}
-#define SPECIALIZED8_IMPL(name, x, op)       \
-	SPECIALIZED8_SINGLE_INS(name, x, op, 1); \
-	SPECIALIZED8_SINGLE_INS(name, x, op, 2); \
-	SPECIALIZED8_SINGLE_INS(name, x, op, 3); \
-	SPECIALIZED8_SINGLE_INS(name, x, op, 4); \
-	SPECIALIZED8_SINGLE_INS(name, x, op, 5); \
-	SPECIALIZED8_SINGLE_INS(name, x, op, 6); \
-	SPECIALIZED8_SINGLE_INS(name, x, op, 7); \
-	SPECIALIZED8_SINGLE_INS(name, x, op, 8); \
-	SPECIALIZED8_INS_X(name, x, op);
+	return NULL;
+}
 
-void execute(IntArray *program, FILE *stream) {
-	int * code = program->values;
-	char *cell = memory;
-#ifdef BFVM_COMPUTED_GOTO
-#define SPECIALIZED8_LABEL(name, x) &&LABEL_##name##_##x
-#define SPECIALIZED8_GOTO(x)                                \
-	SPECIALIZED8_LABEL(x, 1), SPECIALIZED8_LABEL(x, 2),     \
-	    SPECIALIZED8_LABEL(x, 3), SPECIALIZED8_LABEL(x, 4), \
-	    SPECIALIZED8_LABEL(x, 5), SPECIALIZED8_LABEL(x, 6), \
-	    SPECIALIZED8_LABEL(x, 7), SPECIALIZED8_LABEL(x, 8), &&LABEL_##x##_X
+// tokenizes the source into chunks, the first one on the calling thread
+void tokenize_chunks(const char *source, size_t length, Chunk *chunks,
+                     int count) {
+	for(int i = 0; i < count; i++) {
+		chunks[i].begin = source;
+		chunks[i].start = source + length / count * i;
+		chunks[i].end =
+		    i == count - 1 ? source + length : source + length / count * (i + 1);
+	}
+	int started = 1;
+	while(started < count && pthread_create(&chunks[started].thread, NULL,
+	                                        tokenize, &chunks[started]) == 0)
+		started++;
+	// whatever could not get a thread is done here
+	for(int i = started; i < count; i++) tokenize(&chunks[i]);
+	tokenize(&chunks[0]);
+	for(int i = 1; i < started; i++) pthread_join(chunks[i].thread, NULL);
+}
 
-	void *dispatchTable[] = {&&LABEL_START,
-	                         SPECIALIZED8_GOTO(INCR),
-	                         SPECIALIZED8_GOTO(DECR),
-	                         SPECIALIZED8_GOTO(LEFT),
-	                         SPECIALIZED8_GOTO(RIGHT),
-	                         &&LABEL_INPUT,
-	                         &&LABEL_OUTPUT,
-	                         &&LABEL_JMPZ,
-	                         &&LABEL_JMPNZ,
-	                         &&LABEL_RESET_CELL,
-	                         &&LABEL_END};
-#endif
-	LOOP() {
-#ifdef DEBUG
-		disassemble_single(code - program->values, code);
-		printf("\t\tCell: %ld\t\tValue: %u\n", cell - memory, *cell);
+// builds the tree of the source, folding runs of the same command.
+// returns false if the brackets do not match.
+bool parse(const char *source, size_t length, NodeArray *ir) {
+	int count = 1;
+	if(length >= PARALLEL_PARSE_MIN && parseThreads > 1)
+		count = parseThreads;
+	Chunk *chunks = (Chunk *)malloc(sizeof(Chunk) * count);
+	tokenize_chunks(source, length, chunks, count);
+	int depth = 0, lowest = 0;
+	for(int i = 0; i < count; i++) {
+		if(depth + chunks[i].lowest < lowest)
+			lowest = depth + chunks[i].lowest;
+		depth += chunks[i].depth;
+	}
+	bool matched = lowest == 0 && depth == 0;
+	// the library only reports through what its functions return
+#ifndef BFVM_LIBRARY
+	if(lowest < 0)
+		printf("Unmatched ']'!\n");
+	else if(depth > 0)
+		printf("Unmatched '['!\n");
 #endif
-		SWITCH() {
-			SPECIALIZED8_IMPL(INCR, (*cell), +);
-			SPECIALIZED8_IMPL(DECR, (*cell), -);
-			SPECIALIZED8_IMPL(LEFT, cell, -);
-			SPECIALIZED8_IMPL(RIGHT, cell, +);
-			CASE(INPUT) : {
-				*cell = fgetc(stream);
-				DISPATCH();
-			}
-			CASE(OUTPUT) : {
-				putchar(*cell);
-				DISPATCH();
-			}
-			CASE(JMPZ) : {
-				int where = next_code();
-				if(*cell == 0) {
-					code += where;
-				}
-				DISPATCH();
-			}
-			CASE(JMPNZ) : {
-				int where = next_code();
-				if(*cell) {
-					code += where;
+	// the blocks of the open loops, innermost last. a block only grows
+	// while it is the innermost one, so the pointers stay valid.
+	BlockArray open;
+	Block_array_init(&open);
+	Node_array_init(ir);
+	Block_array_insert(&open, ir);
+	Token *last = NULL;
+	for(int i = 0; i < count && matched; i++) {
+		for(int t = 0; t < chunks[i].tokens.size; t++) {
+			Token *     token = &chunks[i].tokens.values[t];
+			NodeArray * block = open.values[open.size - 1];
+			switch(token->command) {
+				case '+':
+				case '-':
+				case '>':
+				case '<': {
+					int value = token->command == '-' || token->command == '<'
+					                ? -token->count
+					                : token->count;
+					// the rest of a run cut by the end of the chunk before
+					if(t == 0 && last != NULL &&
+					   last->command == token->command) {
+						block->values[block->size - 1].value += value;
+						break;
+					}
+					int kind = token->command == '+' || token->command == '-'
+					               ? IR_ADD
+					               : IR_MOVE;
+					Node_array_insert(block,
+					                  ir_node(kind, 0, value, token->source));
+					break;
 				}
-				DISPATCH();
-			}
-			CASE(RESET_CELL) : {
-				*cell = 0;
-				DISPATCH();
-			}
-			CASE(END) : { return; }
-			CASE(START) : {
-				DISPATCH(); // dummy
+				case '.':
+					Node_array_insert(block,
+					                  ir_node(IR_OUTPUT, 0, 0, token->source));
+					break;
+				case ',':
+					Node_array_insert(block,
+					                  ir_node(IR_INPUT, 0, 0, token->source));
+					break;
+				case '[':
+					Node_array_insert(block,
+					                  ir_node(IR_LOOP, 0, 0, token->source));
+					Block_array_insert(&open,
+					                   &block->values[block->size - 1].body);
+					break;
+				case ']': open.size--; break;
 			}
+			last = token;
 		}
 	}
+	Block_array_free(&open);
+	for(int i = 0; i < count; i++) Token_array_free(&chunks[i].tokens);
+	free(chunks);
+	if(!matched)
+		ir_free(ir);
+	return matched;
 }
 
-void print_indent(FILE *f, int level) {
-	for(int i = 0; i < level; i++) fprintf(f, "\t");
+// replaces the nodes of the block with the ones in rebuilt
+void ir_replace(NodeArray *block, NodeArray *rebuilt) {
+	Node_array_free(block);
+	*block = *rebuilt;
 }
 
-void print_signaware(FILE *f, const char *lhs, int rhs) {
-	if(rhs < 0) {
-		fprintf(f, "%s -= %d;\n", lhs, -rhs);
-	} else {
-		fprintf(f, "%s += %d;\n", lhs, rhs);
+// emits the adds accumulated over a straight-line run, followed by a
+// single pointer move for the whole run
+void fold_flush(NodeArray *folded, ChangeArray *changes, int *pointer,
+                int source) {
+	for(int i = 0; i < changes->size; i++) {
+		Change c     = changes->values[i];
+		int    value = cell_wrap(c.value);
+		if(value != 0)
+			Node_array_insert(folded, ir_node(IR_ADD, c.idx, value, source));
+	}
+	if(*pointer != 0)
+		Node_array_insert(folded, ir_node(IR_MOVE, 0, *pointer, source));
+	changes->size = 0;
+	*pointer      = 0;
+}
+
+// Offset and pointer folding: the moves of every straight-line run go
+// into the offsets of its adds, leaving one move before the next node
+// that needs the pointer. adds to a cell that is set next are dropped.
+void pass_fold(NodeArray *block) {
+	NodeArray   folded;
+	ChangeArray changes;
+	Node_array_init(&folded);
+	Node_array_resize(&folded, block->size);
+	Change_array_init(&changes);
+	int pointer = 0, source = 0;
+	for(int i = 0; i < block->size; i++) {
+		Node *node = &block->values[i];
+		source     = node->source;
+		switch(node->kind) {
+			case IR_ADD:
+				apply_total_change(&changes, pointer + node->offset,
+				                   node->value);
+				continue;
+			case IR_MOVE: pointer += node->value; continue;
+			case IR_SET:
+				for(int c = 0; c < changes.size; c++)
+					if(changes.values[c].idx == pointer + node->offset)
+						changes.values[c].value = 0;
+				break;
+			case IR_LOOP: pass_fold(&node->body); break;
+		}
+		fold_flush(&folded, &changes, &pointer, source);
+		Node_array_insert(&folded, *node);
 	}
+	fold_flush(&folded, &changes, &pointer, source);
+	Change_array_free(&changes);
+	ir_replace(block, &folded);
 }
 
-void print_header(FILE *f, int level, bool *headerPrinted, bool fromJump) {
-	if(fromJump && !*headerPrinted) {
-		print_indent(f, level - 1);
-		fprintf(f, "while(*cell) {\n");
-		*headerPrinted = true;
+// Reach: the guard left of the tape only stops a program that touches
+// it, and an access farther left than the guard is wide lands in memory
+// that is not the tape. After all the other passes, every access is
+// brought within REACH_MAX cells of the last cell touched, which is on
+// the tape, by touching the cells in between. The guard is wide enough
+// for that plus a range.
+#define REACH_MAX (1 << 16)
+
+// touches the cells on the way from the last cell touched, at *anchor
+// from the pointer, to within reach of offset, which is touched next
+void reach(NodeArray *block, int *anchor, int offset, int source) {
+	while(abs(offset - *anchor) >= REACH_MAX) {
+		*anchor += offset < *anchor ? 1 - REACH_MAX : REACH_MAX - 1;
+		Node_array_insert(block, ir_node(IR_TOUCH, *anchor, 0, source));
 	}
+	*anchor = offset;
 }
 
-void dump_changes(FILE *f, ChangeArray *totalChange, int pointerShift,
-                  bool isPureLoop, int level, bool *headerPrinted,
-                  bool fromJump) {
-	// isPureLoop = false;
-	// if this is pure loop and the net pointer shift is 0,
-	// we have some interesting possibilites
-	if(isPureLoop && pointerShift == 0) {
-		// decrease the level because we are not gonna
-		// insert a loop anymore
-		level--;
-		// get the total change of the value at present cell
-		int loopVarChange = 0;
-		for(int i = 0; i < totalChange->size; i++) {
-			if(totalChange->values[i].idx == 0) {
-				loopVarChange = totalChange->values[i].value;
+// returns where the last cell touched is from the pointer at the end of
+// the block, which starts at the cell its loop tests
+int reach_block(NodeArray *block) {
+	NodeArray reached;
+	int       anchor = 0;
+	Node_array_init(&reached);
+	Node_array_resize(&reached, block->size);
+	for(int i = 0; i < block->size; i++) {
+		Node *node = &block->values[i];
+		switch(node->kind) {
+			case IR_MOVE: anchor -= node->value; break;
+			case IR_LOOP: {
+				// the loop tests its cell again at the end of the body
+				int end = reach_block(&node->body);
+				reach(&node->body, &end, 0, node->source);
+				reach(&reached, &anchor, 0, node->source);
 				break;
 			}
+			case IR_MUL:
+			case IR_SCAN: reach(&reached, &anchor, 0, node->source); break;
+			default:
+				reach(&reached, &anchor, node->offset, node->source);
+				break;
 		}
-		print_indent(f, level);
-		// for this loop to break, the value at cell[0] must reach
-		// to zero. so we assume that it does with the given delta
-
-		// if the change is negative, then the number of
-		// times this loop is gonna continue is value / change
-		if(loopVarChange < 0) {
-			fprintf(f, "change = cell[0] / %d;\n", -loopVarChange);
-		} else {
-			// if the change is positive, it's gonna take (256 - value) / change
-			fprintf(f, "change = (256 - cell[0]) / %d;\n", loopVarChange);
-		}
-		// now for the rest of the cells, the total change will be
-		// (change * delta of the particular cell)
-		for(int i = 0; i < totalChange->size; i++) {
-			if(totalChange->values[i].idx != 0) {
-				print_indent(f, level);
-				fprintf(f, "cell[%d] += (change * %d);\n",
-				        totalChange->values[i].idx,
-				        totalChange->values[i].value);
+		Node_array_insert(&reached, *node);
+	}
+	ir_replace(block, &reached);
+	return anchor;
+}
+
+void pass_reach(NodeArray *ir) {
+	reach_block(ir);
+}
+
+// Loop idioms: loops that only add, leave the pointer where it was and
+// change their cell by an odd amount become multiplications, or sets
+// when they change nothing else. loops that only move become scans.
+// neither reaches farther than REACH_MAX cells from the pointer.
+void pass_idioms(NodeArray *block) {
+	for(int i = 0; i < block->size; i++) {
+		Node *node = &block->values[i];
+		if(node->kind != IR_LOOP)
+			continue;
+		NodeArray *body = &node->body;
+		pass_idioms(body);
+		if(body->size == 1 && body->values[0].kind == IR_MOVE) {
+			if(abs(body->values[0].value) < REACH_MAX &&
+			   scan_profitable(node->source)) {
+				node->kind  = IR_SCAN;
+				node->value = body->values[0].value;
+				ir_free(body);
 			}
+			continue;
+		}
+		int change = 0;
+		for(int j = 0; j < body->size; j++) {
+			if(body->values[j].kind != IR_ADD ||
+			   abs(body->values[j].offset) >= REACH_MAX) {
+				change = 0;
+				break;
+			}
+			if(body->values[j].offset == 0)
+				change = body->values[j].value;
+		}
+		if((change & 1) == 0)
+			continue;
+		NodeArray targets;
+		Node_array_init(&targets);
+		for(int j = 0; j < body->size; j++)
+			if(body->values[j].offset != 0)
+				Node_array_insert(&targets, body->values[j]);
+		ir_replace(body, &targets);
+		node->kind  = IR_MUL;
+		node->value = change;
+		if(targets.size == 0) {
+			node->kind  = IR_SET;
+			node->value = 0;
+			ir_free(body);
 		}
-		// we explicitly set the cell to 0
-		print_indent(f, level);
-		fprintf(f, "cell[0] = 0;\n");
-		// release the array
-		Change_array_free(totalChange);
-		// we're done
-		return;
-	}
-	print_header(f, level, headerPrinted, fromJump);
-	// dump the changes
-	for(int i = 0; i < totalChange->size; i++) {
-		print_indent(f, level);
-		fprintf(f, "cell[%d]", totalChange->values[i].idx);
-		print_signaware(f, "", totalChange->values[i].value);
-#ifdef DEBUG
-		// print the value of the cell
-		fprintf(f, "#ifdef DEBUG\n");
-		print_indent(f, level);
-		fprintf(
-		    f,
-		    "printf(\"\t\tCell: %%ld\\t\\tValue: %%u\\n\", cell + %d - memory, "
-		    "cell[%d]);\n",
-		    totalChange->values[i].idx, totalChange->values[i].idx);
-		fprintf(f, "#endif\n");
-#endif
-	}
-	if(pointerShift != 0) {
-		print_indent(f, level);
-		print_signaware(f, "cell", pointerShift);
 	}
-#ifdef DEBUG
-	if(pointerShift != 0 || totalChange->size == 0) {
-		// print the value of the cell
-		fprintf(f, "#ifdef DEBUG\n");
-		print_indent(f, level);
-		fprintf(f,
-		        "printf(\"\t\tCell: %%ld\\t\\tValue: %%u\\n\", cell - memory, "
-		        "*cell);\n");
-		fprintf(f, "#endif\n");
+}
+
+// the multiplicative inverse of -change modulo 2^cellBits, the number of
+// trips of a mul loop per unit of its cell. every Newton step doubles the
+// bits that are right, of which an odd number has three to start with.
+int mul_inverse(int change) {
+	unsigned factor = -(unsigned)change, inverse = factor;
+	for(int i = 0; i < 4; i++) inverse *= 2 - factor * inverse;
+	return (int)(inverse & cell_mask());
+}
+
+// What is known about the cells while walking a block: the values of
+// some of them, by their distance from the pointer at the start of the
+// block, and whether all the others are zero, as they are when the
+// program starts. a cell may also be remembered as not known.
+typedef struct {
+	int      idx;
+	unsigned value;
+	bool     known;
+} KnownCell;
+
+ARRAY(KnownCell, KnownCell);
+
+typedef struct {
+	KnownCellArray cells;
+	int            pointer;
+	bool           allZero;
+} Known;
+
+// cells remembered at most, knowing less is always safe
+#define KNOWN_CELLS 32
+
+void known_init(Known *known, bool allZero) {
+	KnownCell_array_init(&known->cells);
+	known->pointer = 0;
+	known->allZero = allZero;
+}
+
+bool known_get(Known *known, int offset, unsigned *value) {
+	int idx = known->pointer + offset;
+	for(int i = 0; i < known->cells.size; i++) {
+		if(known->cells.values[i].idx == idx) {
+			*value = known->cells.values[i].value;
+			return known->cells.values[i].known;
+		}
 	}
-#endif
-	// release the array
-	Change_array_free(totalChange);
+	*value = 0;
+	return known->allZero;
 }
 
-void apply_total_change(ChangeArray *ca, int currentPointer, int totalChange) {
-	for(int i = 0; i < ca->size; i++) {
-		if(ca->values[i].idx == currentPointer) {
-			ca->values[i].value += totalChange;
+void known_set(Known *known, int offset, unsigned value, bool isKnown) {
+	int       idx  = known->pointer + offset;
+	KnownCell cell = {idx, value & cell_mask(), isKnown};
+	for(int i = 0; i < known->cells.size; i++) {
+		if(known->cells.values[i].idx == idx) {
+			known->cells.values[i] = cell;
 			return;
 		}
 	}
-	Change_array_insert(ca, (Change){currentPointer, totalChange});
+	if(known->cells.size == KNOWN_CELLS) {
+		known->cells.size = 0;
+		known->allZero    = false;
+	}
+	KnownCell_array_insert(&known->cells, cell);
 }
 
-#define SPECIALIZED8_SINGLE_LINE2(name, x, op, num)                   \
-	case name##_##num:                                                \
-		apply_total_change(x, currentPointer - startPointer, op num); \
-		break;
-#define SPECIALIZED8_LINE_X2(name, x, op)                    \
-	case name##_X:                                           \
-		apply_total_change(x, currentPointer - startPointer, \
-		                   op * (program++));                \
-		break;
-#define SPECIALIZED8_LINE2(name, x, op)        \
-	SPECIALIZED8_SINGLE_LINE2(name, x, op, 1); \
-	SPECIALIZED8_SINGLE_LINE2(name, x, op, 2); \
-	SPECIALIZED8_SINGLE_LINE2(name, x, op, 3); \
-	SPECIALIZED8_SINGLE_LINE2(name, x, op, 4); \
-	SPECIALIZED8_SINGLE_LINE2(name, x, op, 5); \
-	SPECIALIZED8_SINGLE_LINE2(name, x, op, 6); \
-	SPECIALIZED8_SINGLE_LINE2(name, x, op, 7); \
-	SPECIALIZED8_SINGLE_LINE2(name, x, op, 8); \
-	SPECIALIZED8_LINE_X2(name, x, op);
-
-#define SPECIALIZED8_SINGLE_LINE(name, x, op, num) \
-	case name##_##num:                             \
-		x op## = num;                              \
-		break;
-#define SPECIALIZED8_LINE_X(name, x, op) \
-	case name##_X:                       \
-		x op## = *program++;             \
-		break;
-#define SPECIALIZED8_LINE(name, x, op)        \
-	SPECIALIZED8_SINGLE_LINE(name, x, op, 1); \
-	SPECIALIZED8_SINGLE_LINE(name, x, op, 2); \
-	SPECIALIZED8_SINGLE_LINE(name, x, op, 3); \
-	SPECIALIZED8_SINGLE_LINE(name, x, op, 4); \
-	SPECIALIZED8_SINGLE_LINE(name, x, op, 5); \
-	SPECIALIZED8_SINGLE_LINE(name, x, op, 6); \
-	SPECIALIZED8_SINGLE_LINE(name, x, op, 7); \
-	SPECIALIZED8_SINGLE_LINE(name, x, op, 8); \
-	SPECIALIZED8_LINE_X(name, x, op);
+void known_put(Known *known, int offset, unsigned value) {
+	known_set(known, offset, value, true);
+}
 
-#ifdef DEBUG
-#define SPECIALIZED8_SINGLE_LINE_PRINTF(name, num)            \
-	case name##_##num:                                        \
-		fprintf(f, "printf(\"" #name "\\t\\t" #num "\");\n"); \
-		break;
-#define SPECIALIZED8_LINE_X_PRINTF(name)                                       \
-	case name##_X:                                                             \
-		fprintf(f, "printf(\"" #name "_X\\t\\t%%d\", %d);\n", *(program + 1)); \
-		break;
-#define SPECIALIZED8_PRINTF(name)             \
-	SPECIALIZED8_SINGLE_LINE_PRINTF(name, 1); \
-	SPECIALIZED8_SINGLE_LINE_PRINTF(name, 2); \
-	SPECIALIZED8_SINGLE_LINE_PRINTF(name, 3); \
-	SPECIALIZED8_SINGLE_LINE_PRINTF(name, 4); \
-	SPECIALIZED8_SINGLE_LINE_PRINTF(name, 5); \
-	SPECIALIZED8_SINGLE_LINE_PRINTF(name, 6); \
-	SPECIALIZED8_SINGLE_LINE_PRINTF(name, 7); \
-	SPECIALIZED8_SINGLE_LINE_PRINTF(name, 8); \
-	SPECIALIZED8_LINE_X_PRINTF(name);
-
-void fdisassemble(FILE *f, int ip, int *program, int level) {
-	fprintf(f, "#ifdef DEBUG\n");
-	print_indent(f, level);
-	fprintf(f, "printf(\"%%6d: \", %d);\n", ip);
-	print_indent(f, level);
-	switch(*program) {
-		SPECIALIZED8_PRINTF(INCR);
-		SPECIALIZED8_PRINTF(DECR);
-		SPECIALIZED8_PRINTF(LEFT);
-		SPECIALIZED8_PRINTF(RIGHT);
-		case INPUT: fprintf(f, "printf(\"INPUT\");\n"); break;
-		case OUTPUT: fprintf(f, "printf(\"OUTPUT\");\n"); break;
-		case JMPZ:
-			fprintf(f, "printf(\"JMPZ\\t\\t%%d\", %d);\n", *(program + 1));
-			break;
-		case JMPNZ:
-			fprintf(f, "printf(\"JMPNZ\\t\\t%%d\", %d);\n", *(program + 1));
-			break;
-		case RESET_CELL: fprintf(f, "printf(\"RESET_CELL\");\n"); break;
-		case END: fprintf(f, "printf(\"END\");\n"); break;
-		case START: fprintf(f, "printf(\"START\");\n"); break;
-	}
-	fprintf(f, "#endif\n");
+void known_unset(Known *known, int offset) {
+	known_set(known, offset, 0, false);
 }
 
-#endif
+void known_forget(Known *known) {
+	known->cells.size = 0;
+	known->allZero    = false;
+}
 
-// returns the current cell pointer
-int transpile_rec(FILE *f, int *source, int **pgm, int startPointer, int level,
-                  bool fromJump) {
-	bool headerPrinted = !fromJump;
-	int *program       = *pgm;
-	// Pointer to the present cell, with respect to
-	// the start of the loop
-	int currentPointer = startPointer;
-	// Each cell of the array holds the total increment
-	// / decrement of the cell at pointer i with respect
-	// to the present loop
-	ChangeArray totalChange;
-	Change_array_init(&totalChange);
-	// denotes if this is a pure loop, i.e. a loop containing
-	// no subloops inside
-	bool isPureLoop = true;
-	int  lastOpcode = END;
-	while(1) {
-		int bakOpcode = *program;
-		// flush out the changes as required
-		switch(*program) {
+// updates what is known past the node
+void known_step(Known *known, Node *node) {
+	unsigned value, target;
+	switch(node->kind) {
+		case IR_ADD:
+			if(known_get(known, node->offset, &value))
+				known_put(known, node->offset, value + node->value);
+			break;
+		case IR_SET: known_put(known, node->offset, node->value); break;
+		case IR_MOVE: known->pointer += node->value; break;
+		case IR_INPUT: known_unset(known, node->offset); break;
+		case IR_OUTPUT: break;
+		case IR_MUL: {
+			bool     counted = known_get(known, 0, &value);
+			unsigned times =
+			    value * (unsigned)mul_inverse(node->value) & cell_mask();
+			for(int i = 0; i < node->body.size; i++) {
+				Node *add = &node->body.values[i];
+				if(counted && known_get(known, add->offset, &target))
+					known_put(known, add->offset, target + times * add->value);
+				else
+					known_unset(known, add->offset);
+			}
+			known_put(known, 0, 0);
+			break;
+		}
+		case IR_LOOP:
+		case IR_SCAN:
+			known_forget(known);
+			known_put(known, 0, 0);
+			break;
+	}
+}
+
+// Dead loop elimination: loops entered with their cell known to be zero,
+// such as the comment loop at the start of a program, never run.
+void dead_loops(NodeArray *block, bool programStart) {
+	Known     known;
+	NodeArray kept;
+	known_init(&known, programStart);
+	Node_array_init(&kept);
+	Node_array_resize(&kept, block->size);
+	for(int i = 0; i < block->size; i++) {
+		Node *   node = &block->values[i];
+		unsigned value;
+		if((node->kind == IR_LOOP || node->kind == IR_MUL ||
+		    node->kind == IR_SCAN) &&
+		   known_get(&known, 0, &value) && value == 0) {
+			ir_free(&node->body);
+			continue;
+		}
+		if(node->kind == IR_LOOP)
+			dead_loops(&node->body, false);
+		known_step(&known, node);
+		Node_array_insert(&kept, *node);
+	}
+	KnownCell_array_free(&known.cells);
+	ir_replace(block, &kept);
+}
+
+void pass_dead_loops(NodeArray *ir) {
+	dead_loops(ir, true);
+}
+
+// Known value propagation: a multiplication of a known cell is a
+// constant, so it becomes adds of the products and a set.
+void propagate(NodeArray *block, bool programStart) {
+	Known     known;
+	NodeArray rebuilt;
+	known_init(&known, programStart);
+	Node_array_init(&rebuilt);
+	Node_array_resize(&rebuilt, block->size);
+	for(int i = 0; i < block->size; i++) {
+		Node *   node = &block->values[i];
+		unsigned value;
+		if(node->kind == IR_LOOP)
+			propagate(&node->body, false);
+		if(node->kind == IR_MUL && known_get(&known, 0, &value)) {
+			unsigned times =
+			    value * (unsigned)mul_inverse(node->value) & cell_mask();
+			for(int j = 0; j < node->body.size; j++) {
+				Node add = node->body.values[j];
+				add.value *= times;
+				known_step(&known, &add);
+				Node_array_insert(&rebuilt, add);
+			}
+			ir_free(&node->body);
+			*node = ir_node(IR_SET, 0, 0, node->source);
+		}
+		known_step(&known, node);
+		Node_array_insert(&rebuilt, *node);
+	}
+	KnownCell_array_free(&known.cells);
+	ir_replace(block, &rebuilt);
+}
+
+void pass_propagate(NodeArray *ir) {
+	propagate(ir, true);
+}
+
+// Redundant reset removal: sets of a cell to the value it already has,
+// most often clearing a cell that a loop just left at zero.
+void resets(NodeArray *block, bool programStart) {
+	Known     known;
+	NodeArray kept;
+	known_init(&known, programStart);
+	Node_array_init(&kept);
+	Node_array_resize(&kept, block->size);
+	for(int i = 0; i < block->size; i++) {
+		Node *   node = &block->values[i];
+		unsigned value;
+		if(node->kind == IR_SET && known_get(&known, node->offset, &value) &&
+		   value == (node->value & cell_mask()))
+			continue;
+		if(node->kind == IR_LOOP)
+			resets(&node->body, false);
+		known_step(&known, node);
+		Node_array_insert(&kept, *node);
+	}
+	KnownCell_array_free(&known.cells);
+	ir_replace(block, &kept);
+}
+
+void pass_resets(NodeArray *ir) {
+	resets(ir, true);
+}
+
+typedef struct {
+	const char *name;
+	void (*run)(NodeArray *ir);
+} Pass;
+
+// idioms need folded loop bodies, and the last fold merges the adds
+// that propagation leaves behind
+const Pass passes[] = {
+    {"fold", pass_fold},
+    {"idioms", pass_idioms},
+    {"dead-loops", pass_dead_loops},
+    {"propagate", pass_propagate},
+    {"resets", pass_resets},
+    {"fold", pass_fold},
+};
+
+// print the IR after every pass, and how long each pass took
+bool dumpIR = false, passTimes = false;
+
+void run_passes(NodeArray *ir) {
+	for(size_t i = 0; i < sizeof(passes) / sizeof(Pass); i++) {
+		double start = now();
+		passes[i].run(ir);
+		if(passTimes || dumpIR)
+			fprintf(stderr, "Pass %-10s %fs\n", passes[i].name, now() - start);
+		if(dumpIR)
+			ir_dump(ir, 1);
+	}
+}
+
+// Partial evaluation: with --partial, the program runs at compile time
+// until its first input, and is replaced by a residual program that goes
+// on from there. The residual program prints the output of the run, sets
+// the cells it left nonzero and moves to its cell, then runs the rest of
+// the block the run stopped in and of every block around it, starting
+// each outer one at the loop holding the inner block, which tests its
+// cell again. The run also stops after partialSteps nodes and loop trips,
+// or at a cell outside of its tape, leaving those to the real run.
+// the default budget costs a program that never reads, like e.b, about
+// a fifth of a second of compile time.
+#define PARTIAL_STEPS 50000000L
+#define PARTIAL_CELLS TAPE_CELLS
+
+// the budget of the run at compile time, 0 turns it off
+long partialSteps = 0;
+
+// a node of the program, by the block holding it
+typedef struct {
+	NodeArray *block;
+	int        index;
+} Point;
+
+ARRAY(Point, Point);
+
+enum { PARTIAL_END, PARTIAL_INPUT, PARTIAL_BUDGET, PARTIAL_TAPE };
+
+const char *partialStops[] = {"the end", "the first input", "the budget",
+                              "the edge of the tape"};
+
+typedef struct {
+	unsigned * tape; // wrapped around at the width of the cells
+	long       pointer;
+	long       steps; // nodes and loop trips run
+	long       high;  // the rightmost cell touched
+	int        stop;  // why the run stopped
+	ByteArray  output;
+	PointArray path; // the nodes it stopped at, innermost first
+} Partial;
+
+// returns the cell at offset from the pointer, NULL if it is not on the
+// tape of the run
+unsigned *partial_cell(Partial *p, int offset) {
+	long idx = p->pointer + offset;
+	if(idx < 0 || idx >= PARTIAL_CELLS) {
+		p->stop = PARTIAL_TAPE;
+		return NULL;
+	}
+	if(idx > p->high)
+		p->high = idx;
+	return &p->tape[idx];
+}
+
+bool partial_budget(Partial *p) {
+	if(p->steps == partialSteps) {
+		p->stop = PARTIAL_BUDGET;
+		return false;
+	}
+	p->steps++;
+	return true;
+}
+
+bool partial_block(Partial *p, NodeArray *block);
+
+// runs the node, returns false if the run stopped before it, which
+// leaves the state as it would be at the node, or inside of its body
+bool partial_node(Partial *p, Node *node) {
+	if(node->kind == IR_INPUT) {
+		p->stop = PARTIAL_INPUT;
+		return false;
+	}
+	if(!partial_budget(p))
+		return false;
+	if(node->kind == IR_MOVE) {
+		p->pointer += node->value;
+		return true;
+	}
+	unsigned *cell = partial_cell(p, node->offset);
+	if(cell == NULL)
+		return false;
+	switch(node->kind) {
+		case IR_ADD: *cell = (*cell + node->value) & cell_mask(); break;
+		case IR_SET: *cell = node->value & cell_mask(); break;
+		case IR_OUTPUT: Byte_array_insert(&p->output, *cell); break;
+		case IR_MUL: {
+			if(*cell == 0)
+				break;
+			// every target has to be on the tape before any of them changes
+			for(int i = 0; i < node->body.size; i++)
+				if(partial_cell(p, node->body.values[i].offset) == NULL)
+					return false;
+			unsigned times =
+			    *cell * (unsigned)mul_inverse(node->value) & cell_mask();
+			for(int i = 0; i < node->body.size; i++) {
+				unsigned *target = partial_cell(p, node->body.values[i].offset);
+				*target = (*target + times * node->body.values[i].value) &
+				          cell_mask();
+			}
+			*cell = 0;
+			break;
+		}
+		case IR_SCAN:
+			while(*cell != 0) {
+				if(!partial_budget(p))
+					return false;
+				p->pointer += node->value;
+				if((cell = partial_cell(p, 0)) == NULL)
+					return false;
+			}
+			break;
+		case IR_LOOP:
+			while(*cell != 0) {
+				if(!partial_budget(p) || !partial_block(p, &node->body) ||
+				   (cell = partial_cell(p, 0)) == NULL)
+					return false;
+			}
+			break;
+	}
+	return true;
+}
+
+bool partial_block(Partial *p, NodeArray *block) {
+	for(int i = 0; i < block->size; i++) {
+		if(!partial_node(p, &block->values[i])) {
+			Point_array_insert(&p->path, (Point){block, i});
+			return false;
+		}
+	}
+	return true;
+}
+
+// builds the program going on from where the run stopped
+void partial_residual(Partial *p, NodeArray *residual) {
+	Node_array_init(residual);
+	for(int i = 0; i < p->output.size; i++) {
+		Node_array_insert(residual, ir_node(IR_SET, 0, p->output.values[i], 0));
+		Node_array_insert(residual, ir_node(IR_OUTPUT, 0, 0, 0));
+	}
+	// nothing reads the tape of a program that has ended
+	if(p->stop == PARTIAL_END)
+		return;
+	// the other cells are still zero, as the output only used this one
+	Node_array_insert(residual, ir_node(IR_SET, 0, p->tape[0], 0));
+	for(long idx = 1; idx <= p->high; idx++)
+		if(p->tape[idx] != 0)
+			Node_array_insert(residual,
+			                  ir_node(IR_ADD, idx, cell_wrap(p->tape[idx]), 0));
+	if(p->pointer != 0)
+		Node_array_insert(residual, ir_node(IR_MOVE, 0, p->pointer, 0));
+	for(int level = 0; level < p->path.size; level++) {
+		Point at = p->path.values[level];
+		for(int i = at.index; i < at.block->size; i++)
+			Node_array_insert(residual, ir_copy(&at.block->values[i]));
+	}
+}
+
+// replaces the program with its residual program, which goes through
+// the passes again, as the cells set at its start are known
+void partial_eval(NodeArray *ir) {
+	double  start = now();
+	Partial p;
+	memset(&p, 0, sizeof(p));
+	p.tape = (unsigned *)calloc(PARTIAL_CELLS, sizeof(unsigned));
+	Byte_array_init(&p.output);
+	Point_array_init(&p.path);
+	p.stop = PARTIAL_END;
+	partial_block(&p, ir);
+	// a run that did nothing leaves the program as it is
+	if(p.steps > 0) {
+		NodeArray residual;
+		partial_residual(&p, &residual);
+		ir_free(ir);
+		*ir = residual;
+	}
+	if(passTimes || dumpIR)
+		fprintf(stderr,
+		        "Pass %-10s %fs, %ld steps, %d bytes of output, stopped at "
+		        "%s\n",
+		        "partial", now() - start, p.steps, p.output.size,
+		        partialStops[p.stop]);
+	if(dumpIR)
+		ir_dump(ir, 1);
+	if(p.steps > 0)
+		run_passes(ir);
+	free(p.tape);
+	Byte_array_free(&p.output);
+	Point_array_free(&p.path);
+}
+
+// parses the source and runs it through the passes
+bool build_ir(const char *source, size_t length, NodeArray *ir) {
+	double start = now();
+	if(!parse(source, length, ir))
+		return false;
+	if(passTimes || dumpIR)
+		fprintf(stderr, "Pass %-10s %fs\n", "parse", now() - start);
+	if(dumpIR)
+		ir_dump(ir, 1);
+	run_passes(ir);
+	// the profiler has to see the whole program run
+	if(partialSteps > 0 && !profile.collect)
+		partial_eval(ir);
+	// last, as the passes before move the accesses around
+	pass_reach(ir);
+	return true;
+}
+
+// Ranges: clears of adjacent cells with nothing but moves between them,
+// as [-]>[-]>[-] leaves them, reset all the cells at once, and adds to
+// adjacent cells, straight or from a mul loop, add a window of values
+// at once. both the bytecode and the C code use them.
+#define RANGE_MIN 3
+#define RANGE_MAX 32
+
+// returns how many nodes from block[i] on clear a range of at least
+// RANGE_MIN cells, storing its first cell and size, and the move of the
+// pointer up to the last clear, or 0
+int clear_range(NodeArray *block, int i, int *first, int *count,
+                int *pointer) {
+	int low = 0, high = -1, at = 0, end = i;
+	for(int j = i; j < block->size; j++) {
+		Node *node = &block->values[j];
+		if(node->kind == IR_MOVE) {
+			at += node->value;
+			continue;
+		}
+		int idx = at + node->offset;
+		if(node->kind != IR_SET || (node->value & cell_mask()) != 0)
+			break;
+		if(high < low)
+			low = high = idx;
+		else if(idx == low - 1 && high - low + 1 < RANGE_MAX)
+			low = idx;
+		else if(idx == high + 1 && high - low + 1 < RANGE_MAX)
+			high = idx;
+		else if(idx < low || idx > high)
+			break;
+		end      = j + 1;
+		*pointer = at;
+	}
+	*first = low;
+	*count = high - low + 1;
+	return *count >= RANGE_MIN ? end - i : 0;
+}
+
+// returns how many adds from block[i] on add to a window of at least
+// RANGE_MIN adjacent cells, storing its first cell and the values by
+// their distance from it, or 0
+int add_window(NodeArray *block, int i, int *first, int *values) {
+	int      low = INT_MAX, high = INT_MIN, end = i;
+	uint64_t seen = 0;
+	while(end < block->size && block->values[end].kind == IR_ADD &&
+	      end - i < RANGE_MAX) {
+		int offset = block->values[end++].offset;
+		low        = offset < low ? offset : low;
+		high       = offset > high ? offset : high;
+	}
+	if(end - i < RANGE_MIN || high - low + 1 != end - i)
+		return 0;
+	for(int j = i; j < end; j++) {
+		int distance = block->values[j].offset - low;
+		if(seen & (1ull << distance))
+			return 0;
+		seen |= 1ull << distance;
+		values[distance] = block->values[j].value;
+	}
+	*first = low;
+	return end - i;
+}
+
+// the ints a window of count values takes, packed as cells
+int range_words(int count, int bits) {
+	return (count * (bits / 8) + 3) / 4;
+}
+
+// the value at index of a packed window, sign extended
+int range_value(const int *words, int index, int bits) {
+	uint32_t value = 0;
+	memcpy(&value, (const char *)words + index * (bits / 8), bits / 8);
+	return (int)(value << (32 - bits)) >> (32 - bits);
+}
+
+// the most ints the bytecode of the block can take
+int lowered_size(NodeArray *block) {
+	int size = 0;
+	for(int i = 0; i < block->size; i++) {
+		Node *node = &block->values[i];
+		switch(node->kind) {
+			case IR_LOOP: size += 4 + lowered_size(&node->body); break;
+			case IR_MUL: size += 3 + node->body.size * 2; break;
+			default: size += 3; break;
+		}
+	}
+	return size;
+}
+
+// attributes everything emitted since the last call to the source offset
+void lower_map(IntArray *program, int source) {
+	if(profile.collect)
+		while(profile.sourceMap.size < program->size)
+			int_array_insert(&profile.sourceMap, source);
+}
+
+void lower_move(IntArray *program, int value) {
+	if(value > 0)
+		insert_repeat(program, RIGHT_1, value);
+	else if(value < 0)
+		insert_repeat(program, LEFT_1, -value);
+}
+
+// emits the values of a window, packed as cells
+void lower_window(IntArray *program, const int *values, int count) {
+	int packed[RANGE_MAX] = {0};
+	for(int i = 0; i < count; i++)
+		memcpy((char *)packed + i * (cellBits / 8), &values[i], cellBits / 8);
+	for(int i = 0; i < range_words(count, cellBits); i++)
+		int_array_insert(program, packed[i]);
+}
+
+// emits the bytecode of a block. sets, inputs and outputs always work on
+// cell[0], the fold pass leaves them no offset.
+void lower_block(IntArray *program, NodeArray *block) {
+	for(int i = 0; i < block->size; i++) {
+		Node *node = &block->values[i];
+		int   first, count, pointer, nodes, values[RANGE_MAX];
+		switch(node->kind) {
+			case IR_ADD:
+				if((count = add_window(block, i, &first, values)) > 0) {
+					int_array_insert(program, ADD_RANGE);
+					int_array_insert(program, range_words(count, cellBits));
+					int_array_insert(program, count);
+					int_array_insert(program, first);
+					lower_window(program, values, count);
+					i += count - 1;
+				} else if(node->offset != 0) {
+					int_array_insert(program, ADD_AT);
+					int_array_insert(program, node->offset);
+					int_array_insert(program, node->value);
+				} else if(node->value > 0)
+					insert_repeat(program, INCR_1, node->value);
+				else
+					insert_repeat(program, DECR_1, -node->value);
+				break;
+			case IR_SET:
+				if((nodes = clear_range(block, i, &first, &count, &pointer))) {
+					int_array_insert(program, CLEAR_RANGE);
+					int_array_insert(program, first);
+					int_array_insert(program, count);
+					lower_move(program, pointer);
+					i += nodes - 1;
+					break;
+				}
+				int_array_insert(program, RESET_CELL);
+				if(node->value & cell_mask())
+					insert_repeat(program, INCR_1, node->value & cell_mask());
+				break;
+			case IR_MOVE: lower_move(program, node->value); break;
+			case IR_INPUT: int_array_insert(program, INPUT); break;
+			case IR_OUTPUT: int_array_insert(program, OUTPUT); break;
+			case IR_TOUCH:
+				int_array_insert(program, ADD_AT);
+				int_array_insert(program, node->offset);
+				int_array_insert(program, 0);
+				break;
+			case IR_LOOP: {
+				int_array_insert(program, JMPZ);
+				int_array_insert(program, 0);
+				lower_map(program, node->source);
+				int bodyStart = program->size;
+				lower_block(program, &node->body);
+				int_array_insert(program, JMPNZ);
+				int_array_insert(program, bodyStart - program->size - 1);
+				program->values[bodyStart - 1] = program->size - bodyStart;
+				break;
+			}
+			case IR_MUL:
+				if(add_window(&node->body, 0, &first, values) ==
+				   node->body.size) {
+					count = node->body.size;
+					int_array_insert(program, MUL_RANGE);
+					int_array_insert(program, range_words(count, cellBits));
+					int_array_insert(program, count);
+					int_array_insert(program, mul_inverse(node->value));
+					int_array_insert(program, first);
+					lower_window(program, values, count);
+					break;
+				}
+				int_array_insert(program, MUL_LOOP);
+				int_array_insert(program, node->body.size);
+				int_array_insert(program, mul_inverse(node->value));
+				for(int j = 0; j < node->body.size; j++) {
+					int_array_insert(program, node->body.values[j].offset);
+					int_array_insert(program, node->body.values[j].value);
+				}
+				break;
+			case IR_SCAN:
+				int_array_insert(program,
+				                 node->value > 0 ? SCAN_RIGHT : SCAN_LEFT);
+				int_array_insert(program, abs(node->value));
+				break;
+		}
+		lower_map(program, node->source);
+	}
+}
+
+IntArray *lower(NodeArray *ir) {
+	IntArray *program = (IntArray *)malloc(sizeof(IntArray));
+	int_array_init(program);
+	int_array_resize(program, lowered_size(ir) + 1);
+	if(profile.collect)
+		int_array_init(&profile.sourceMap);
+	lower_block(program, ir);
+	int_array_insert(program, END);
+	lower_map(program, ir->size > 0 ? ir->values[ir->size - 1].source : 0);
+	// release the unused part of the estimate
+	int_array_resize(program, program->size);
+	return program;
+}
+
+IntArray *compile(const char *source, size_t length) {
+	NodeArray ir;
+	if(!build_ir(source, length, &ir))
+		return NULL;
+	IntArray *program = lower(&ir);
+	ir_free(&ir);
+	return program;
+}
+
+// returns the number of ints taken by the instruction at ins
+int instruction_length(const int *ins) {
+	switch(*ins) {
+		case INCR_X:
+		case DECR_X:
+		case LEFT_X:
+		case RIGHT_X:
+		case JMPZ:
+		case JMPNZ:
+		case SCAN_LEFT:
+		case SCAN_RIGHT: return 2;
+		case ADD_AT:
+		case CLEAR_RANGE: return 3;
+		case MUL_LOOP: return 3 + ins[1] * 2;
+		case ADD_RANGE: return 4 + ins[1];
+		case MUL_RANGE: return 5 + ins[1];
+		default:
+			if(*ins > END) {
+				// the operands of all the parts
+				const int *parts  = superParts[*ins - END - 1];
+				int        length = 1;
+				for(int i = 0; i < 3; i++)
+					length += instruction_length(&parts[i]) - 1;
+				return length;
+			}
+			return 1;
+	}
+}
+
+// whether the first operand of the instruction tells its length
+bool variable_length(int op) {
+	return op == MUL_LOOP || op == ADD_RANGE || op == MUL_RANGE;
+}
+
+bool is_jump(int op) {
+	return op == JMPZ || op == JMPNZ;
+}
+
+// stores the indices of the jump offsets among the operands of the
+// instruction in offsets, and returns how many there are. every offset
+// counts from the operand after it.
+int jump_offsets(const int *ins, int *offsets) {
+	if(is_jump(*ins)) {
+		offsets[0] = 1;
+		return 1;
+	}
+	int count = 0;
+	if(*ins > END)
+		for(int i = 0, at = 1; i < 3; i++) {
+			const int *part = &superParts[*ins - END - 1][i];
+			if(is_jump(*part))
+				offsets[count++] = at;
+			at += instruction_length(part) - 1;
+		}
+	return count;
+}
+
+#define SPECIALIZED8_SINGLE_LINE_DEBUG(name, num) \
+	case name##_##num:                            \
+		printf(#name "\t\t" #num);                \
+		break;
+#define SPECIALIZED8_LINE_X_DEBUG(name)           \
+	case name##_X:                                \
+		printf(#name "_X\t\t%d", *(program + 1)); \
+		return ip + 2;
+#define SPECIALIZED8_DEBUG(name)             \
+	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 1); \
+	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 2); \
+	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 3); \
+	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 4); \
+	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 5); \
+	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 6); \
+	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 7); \
+	SPECIALIZED8_SINGLE_LINE_DEBUG(name, 8); \
+	SPECIALIZED8_LINE_X_DEBUG(name);
+
+#define SPECIALIZED8_NAMES(x)                                            \
+	#x "_1", #x "_2", #x "_3", #x "_4", #x "_5", #x "_6", #x "_7", #x "_8", \
+	    #x "_X"
+
+// the names of the opcodes, as they are in the enum
+const char *opcodeNames[] = {"START",
+                             SPECIALIZED8_NAMES(INCR),
+                             SPECIALIZED8_NAMES(DECR),
+                             SPECIALIZED8_NAMES(LEFT),
+                             SPECIALIZED8_NAMES(RIGHT),
+                             "INPUT",
+                             "OUTPUT",
+                             "JMPZ",
+                             "JMPNZ",
+                             "RESET_CELL",
+                             "ADD_AT",
+                             "MUL_LOOP",
+                             "SCAN_LEFT",
+                             "SCAN_RIGHT",
+                             "CLEAR_RANGE",
+                             "ADD_RANGE",
+                             "MUL_RANGE",
+                             "END",
+#define SUPER(name, a, b, c) #name,
+#include "superinstructions.h"
+#undef SUPER
+};
+
+int disassemble_single(int ip, int *program) {
+	printf("%6d: ", ip);
+	switch(*program) {
+		SPECIALIZED8_DEBUG(INCR);
+		SPECIALIZED8_DEBUG(DECR);
+		SPECIALIZED8_DEBUG(LEFT);
+		SPECIALIZED8_DEBUG(RIGHT);
+		case INPUT: printf("INPUT"); break;
+		case OUTPUT: printf("OUTPUT"); break;
+		case JMPZ: printf("JMPZ\t\t%d", *(program + 1)); return ip + 2;
+		case JMPNZ: printf("JMPNZ\t\t%d", *(program + 1)); return ip + 2;
+		case RESET_CELL: printf("RESET_CELL"); break;
+		case ADD_AT:
+			printf("ADD_AT\t\t%d, %d", *(program + 1), *(program + 2));
+			return ip + 3;
+		case MUL_LOOP:
+			printf("MUL_LOOP\t%d", *(program + 2));
+			for(int i = 0; i < *(program + 1); i++)
+				printf(", %d * %d", *(program + 3 + i * 2),
+				       *(program + 4 + i * 2));
+			return ip + 3 + *(program + 1) * 2;
+		case CLEAR_RANGE:
+			printf("CLEAR_RANGE\t%d, %d", *(program + 1), *(program + 2));
+			return ip + 3;
+		case ADD_RANGE:
+		case MUL_RANGE: {
+			bool mul = *program == MUL_RANGE;
+			if(mul)
+				printf("MUL_RANGE\t%d, %d *", *(program + 3), *(program + 4));
+			else
+				printf("ADD_RANGE\t%d", *(program + 3));
+			for(int i = 0; i < *(program + 2); i++)
+				printf("%s%d", i > 0 || !mul ? ", " : " ",
+				       range_value(program + 4 + mul, i, cellBits));
+			return ip + instruction_length(program);
+		}
+		case SCAN_LEFT: printf("SCAN_LEFT\t%d", *(program + 1)); return ip + 2;
+		case SCAN_RIGHT:
+			printf("SCAN_RIGHT\t%d", *(program + 1));
+			return ip + 2;
+		case END: printf("END"); break;
+		case START: printf("START"); break;
+		default:
+			printf("%s\t", opcodeNames[*program]);
+			for(int i = 1; i < instruction_length(program); i++)
+				printf("%s%d", i > 1 ? ", " : "", program[i]);
+			return ip + instruction_length(program);
+	}
+	return ip + 1;
+}
+
+void disassemble_all(IntArray *pgm) {
+	int *program = pgm->values;
+	for(int i = 0; i < pgm->size;) {
+		i = disassemble_single(i, &program[i]);
+		printf("\n");
+	}
+	printf("\n");
+}
+
+// The compact encoding stores every opcode in a byte, followed by its
+// operands in one byte if they fit in [-126, 127]. Larger operands are
+// a marker byte followed by a 16 or a 32 bit value. Jump offsets are
+// counted in bytes, from the end of the jump instruction.
+#define COMPACT_OPERAND16 -127
+#define COMPACT_OPERAND32 -128
+
+int operand_size(int value) {
+	if(value > COMPACT_OPERAND16 && value <= INT8_MAX)
+		return 1;
+	if(value >= INT16_MIN && value <= INT16_MAX)
+		return 3;
+	return 5;
+}
+
+void insert_operand(ByteArray *code, int value, int size) {
+	if(size == 1) {
+		Byte_array_insert(code, (int8_t)value);
+	} else if(size == 3) {
+		int16_t v = value;
+		Byte_array_insert(code, (Byte)COMPACT_OPERAND16);
+		Byte_array_insert(code, v & 0xFF);
+		Byte_array_insert(code, (v >> 8) & 0xFF);
+	} else {
+		Byte_array_insert(code, (Byte)COMPACT_OPERAND32);
+		for(int i = 0; i < 4; i++) Byte_array_insert(code, (value >> (8 * i)));
+	}
+}
+
+static inline int read_operand(const Byte **code) {
+	int8_t value = (int8_t) * (*code)++;
+	if(value > COMPACT_OPERAND16)
+		return value;
+	if(value == COMPACT_OPERAND16) {
+		int16_t v;
+		memcpy(&v, *code, 2);
+		*code += 2;
+		return v;
+	}
+	int32_t v;
+	memcpy(&v, *code, 4);
+	*code += 4;
+	return v;
+}
+
+static inline void skip_operands(const Byte **code, int count) {
+	while(count--) read_operand(code);
+}
+
+ByteArray *compact(IntArray *program) {
+	int *code = program->values;
+	int  size = program->size;
+	// byte address of every opcode and operand, and the size of every
+	// jump offset, 0 for anything else. jumps start out short and only
+	// ever grow, so the loop below stops once all of them fit.
+	int *address  = (int *)malloc(sizeof(int) * (size + 1));
+	int *jumpSize = (int *)calloc(size, sizeof(int));
+	for(int ip = 0; ip < size; ip += instruction_length(&code[ip])) {
+		int offsets[3], count = jump_offsets(&code[ip], offsets);
+		for(int i = 0; i < count; i++) jumpSize[ip + offsets[i]] = 1;
+	}
+	bool grown = true;
+	while(grown) {
+		int at = 0;
+		for(int ip = 0; ip < size; ip += instruction_length(&code[ip])) {
+			address[ip] = at++;
+			for(int i = ip + 1; i < ip + instruction_length(&code[ip]); i++) {
+				address[i] = at;
+				at += jumpSize[i] ? jumpSize[i] : operand_size(code[i]);
+			}
+		}
+		address[size] = at;
+		grown         = false;
+		for(int i = 0; i < size; i++) {
+			if(jumpSize[i] == 0)
+				continue;
+			int relative = address[i + 1 + code[i]] - address[i + 1];
+			if(operand_size(relative) > jumpSize[i]) {
+				jumpSize[i] = operand_size(relative);
+				grown       = true;
+			}
+		}
+	}
+	ByteArray *compacted = (ByteArray *)malloc(sizeof(ByteArray));
+	Byte_array_init(compacted);
+	Byte_array_resize(compacted, address[size]);
+	for(int ip = 0; ip < size; ip += instruction_length(&code[ip])) {
+		Byte_array_insert(compacted, code[ip]);
+		for(int i = ip + 1; i < ip + instruction_length(&code[ip]); i++) {
+			if(jumpSize[i])
+				insert_operand(compacted,
+				               address[i + 1 + code[i]] - address[i + 1],
+				               jumpSize[i]);
+			else
+				insert_operand(compacted, code[i], operand_size(code[i]));
+		}
+	}
+	free(address);
+	free(jumpSize);
+	return compacted;
+}
+
+// prints the instruction at the byte address ip of a compact program,
+// returns the address of the next one
+int disassemble_compact(int ip, const Byte *program) {
+	const Byte *code = program;
+	IntArray    ins;
+	int_array_init(&ins);
+	int_array_insert(&ins, *code++);
+	// the length is only known after the first operand
+	if(variable_length(ins.values[0]))
+		int_array_insert(&ins, read_operand(&code));
+	while(ins.size < instruction_length(ins.values))
+		int_array_insert(&ins, read_operand(&code));
+	disassemble_single(ip, ins.values);
+	int_array_free(&ins);
+	return ip + (code - program);
+}
+
+// Superinstructions are sequences of instructions that the samples run
+// often, fused into one that does all of them in a single dispatch. They
+// are found by superinstructions.sh from the statistics of --ngrams.
+// Only the first instruction of a sequence can be a jump target, but a
+// jump skipping a loop lands right after its JMPNZ, and a loop going
+// around lands right after its JMPZ, so those may also land on the start
+// of a sequence made of the same kind of jumps: running them again does
+// nothing, as the cell is the one they just tested.
+bool fusion = true;
+
+// whether the parts, START padded, can be fused
+bool fuse_valid(const int *parts) {
+	if(parts[0] == START || parts[1] == START)
+		return false;
+	for(int i = 0; i < 3 && parts[i] != START; i++) {
+		if(variable_length(parts[i]) || parts[i] >= END)
+			return false;
+		if(i == 0 || !is_jump(parts[i - 1]))
+			continue;
+		for(int j = 0; j < i; j++)
+			if(parts[j] != parts[i - 1])
+				return false;
+	}
+	return true;
+}
+
+// returns the longest fused instruction that starts at ip, or START
+int fuse_match(const int *code, int ip, int size) {
+	int best = START, bestLength = 0;
+	for(int op = END + 1; op < OPCODE_COUNT; op++) {
+		const int *parts = superParts[op - END - 1];
+		int        at = ip, count = 0;
+		if(!fuse_valid(parts))
+			continue;
+		while(count < 3 && parts[count] != START && at < size &&
+		      code[at] == parts[count])
+			at += instruction_length(&code[at]), count++;
+		if((count == 3 || parts[count] == START) && count > bestLength) {
+			best       = op;
+			bestLength = count;
+		}
+	}
+	return best;
+}
+
+// returns the program with the sequences replaced by their fused
+// instructions
+IntArray *fuse(const IntArray *program) {
+	const int *code = program->values;
+	int        size = program->size;
+	// the new address of every instruction, which for the later parts of
+	// a sequence is that of the sequence, and the new place of every
+	// operand
+	int *     address = (int *)malloc(sizeof(int) * (size + 1));
+	int *     moved   = (int *)malloc(sizeof(int) * size);
+	IntArray *fused   = (IntArray *)malloc(sizeof(IntArray));
+	int_array_init(fused);
+	int_array_resize(fused, size);
+	for(int ip = 0; ip < size;) {
+		int op    = fuse_match(code, ip, size);
+		int parts = 1, start = fused->size;
+		if(op != START)
+			while(parts < 3 && superParts[op - END - 1][parts] != START)
+				parts++;
+		int_array_insert(fused, op != START ? op : code[ip]);
+		while(parts--) {
+			int length  = instruction_length(&code[ip]);
+			address[ip] = start;
+			for(int i = 1; i < length; i++) {
+				moved[ip + i] = fused->size;
+				int_array_insert(fused, code[ip + i]);
+			}
+			ip += length;
+		}
+	}
+	address[size] = fused->size;
+	// point the jumps at the new addresses of their targets
+	for(int ip = 0; ip < size; ip += instruction_length(&code[ip])) {
+		int offsets[3], count = jump_offsets(&code[ip], offsets);
+		for(int i = 0; i < count; i++) {
+			int at = ip + offsets[i];
+			fused->values[moved[at]] =
+			    address[at + 1 + code[at]] - (moved[at] + 1);
+		}
+	}
+	free(address);
+	free(moved);
+	return fused;
+}
+
+// The statistics of --ngrams: how often every sequence of two or three
+// instructions that could be fused ran, pairs being sequences ending
+// with START.
+#define NGRAM_OPS (END + 1)
+#define NGRAM_INDEX(a, b, c) (((a)*NGRAM_OPS + (b)) * NGRAM_OPS + (c))
+
+uint64_t *ngramCounts;
+uint64_t  ngramTotal;
+int       ngramLast[2]; // the two instructions before the present one
+
+static inline void ngram_record(int op) {
+	int pair[3]   = {ngramLast[1], op, START};
+	int triple[3] = {ngramLast[0], ngramLast[1], op};
+	ngramTotal++;
+	if(fuse_valid(pair))
+		ngramCounts[NGRAM_INDEX(pair[0], pair[1], START)]++;
+	if(fuse_valid(triple))
+		ngramCounts[NGRAM_INDEX(triple[0], triple[1], op)]++;
+	ngramLast[0] = ngramLast[1];
+	ngramLast[1] = op;
+}
+
+int ngram_compare(const void *a, const void *b) {
+	uint64_t x = ngramCounts[*(const int *)a], y = ngramCounts[*(const int *)b];
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// writes the sequences that ran, the most frequent first, after the
+// number of dispatches they are out of
+bool ngram_save(const char *filename) {
+	FILE *f = fopen(filename, "wb");
+	if(f == NULL)
+		return false;
+	int *order = (int *)malloc(sizeof(int) * NGRAM_OPS * NGRAM_OPS * NGRAM_OPS);
+	int  count = 0;
+	for(int i = 0; i < NGRAM_OPS * NGRAM_OPS * NGRAM_OPS; i++)
+		if(ngramCounts[i] > 0)
+			order[count++] = i;
+	qsort(order, count, sizeof(int), ngram_compare);
+	fprintf(f, "bfvm-ngrams %llu\n", (unsigned long long)ngramTotal);
+	for(int i = 0; i < count; i++) {
+		int index = order[i];
+		int last  = index % NGRAM_OPS;
+		fprintf(f, "%llu %s %s", (unsigned long long)ngramCounts[index],
+		        opcodeNames[index / NGRAM_OPS / NGRAM_OPS],
+		        opcodeNames[index / NGRAM_OPS % NGRAM_OPS]);
+		if(last != START)
+			fprintf(f, " %s", opcodeNames[last]);
+		fprintf(f, "\n");
+	}
+	free(order);
+	return fclose(f) == 0;
+}
+
+// The I/O layer owned by the VM. Output is collected in a buffer which
+// is written out with write(2) when it is full, before any input is
+// read, and when the program ends. On a terminal it also goes out at
+// every newline and every TERMINAL_BUFFER_SIZE bytes, for the output
+// of long runs to show as it comes. An input file is mapped and consumed
+// straight from the mapping, stdin (or anything that cannot be mapped)
+// is read in large chunks with read(2).
+#ifndef IO_BUFFER_SIZE
+#define IO_BUFFER_SIZE (1 << 16)
+#endif
+#define TERMINAL_BUFFER_SIZE 64
+
+// With --async-output, io_flush hands the output to a thread of its own
+// that writes it out, so a slow reader of the output does not hold up
+// the program. They share a ring only the program adds to and only the
+// writer takes from, and either of them sleeps on a futex while the
+// ring is empty or full. The counters wrap around, which RING_SIZE
+// dividing 2^32 keeps harmless.
+#define RING_SIZE (1u << 20)
+
+// reports the first write of the output that fails, what cannot be
+// written is dropped
+void output_failed(bool *reported) {
+	if(!*reported)
+		fprintf(stderr, "Unable to write the output: %s!\n", strerror(errno));
+	*reported = true;
+}
+
+typedef struct {
+	// bytes added, only moved by the program
+	uint32_t head __attribute__((aligned(64)));
+	// bytes written, only moved by the writer
+	uint32_t tail __attribute__((aligned(64)));
+	// bumped when head moves or the ring closes, for the writer to sleep on
+	uint32_t  posted __attribute__((aligned(64)));
+	bool      closing, failed;
+	int       fd;
+	pthread_t writer;
+	char      data[RING_SIZE];
+} Ring;
+
+bool asyncOutput = false;
+
+void futex_wait(uint32_t *word, uint32_t value) {
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void futex_wake(uint32_t *word) {
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void *ring_writer(void *arg) {
+	Ring *ring = (Ring *)arg;
+	while(1) {
+		uint32_t posted = __atomic_load_n(&ring->posted, __ATOMIC_ACQUIRE);
+		uint32_t head   = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint32_t tail   = ring->tail;
+		if(head == tail) {
+			if(__atomic_load_n(&ring->closing, __ATOMIC_ACQUIRE))
+				return NULL;
+			futex_wait(&ring->posted, posted);
+			continue;
+		}
+		// up to the end of the ring in one go, the rest next time
+		uint32_t at   = tail % RING_SIZE;
+		uint32_t size = head - tail;
+		if(size > RING_SIZE - at)
+			size = RING_SIZE - at;
+		ssize_t res = write(ring->fd, ring->data + at, size);
+		if(res < 0 && errno != EINTR) {
+			output_failed(&ring->failed);
+			res = size;
+		}
+		if(res > 0) {
+			__atomic_store_n(&ring->tail, tail + res, __ATOMIC_RELEASE);
+			futex_wake(&ring->tail);
+		}
+	}
+}
+
+// starts the writer of the output to fd, returns NULL if it cannot
+Ring *ring_open(int fd) {
+	Ring *ring = (Ring *)aligned_alloc(64, sizeof(Ring));
+	if(ring == NULL)
+		return NULL;
+	memset(ring, 0, offsetof(Ring, data));
+	ring->fd = fd;
+	if(pthread_create(&ring->writer, NULL, ring_writer, ring) != 0) {
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+// adds the bytes to the ring, waiting for room as long as it is full
+void ring_push(Ring *ring, const char *data, size_t size) {
+	uint32_t head = ring->head;
+	while(size > 0) {
+		uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if(head - tail == RING_SIZE) {
+			futex_wait(&ring->tail, tail);
+			continue;
+		}
+		uint32_t at   = head % RING_SIZE;
+		uint32_t room = RING_SIZE - (head - tail);
+		if(room > RING_SIZE - at)
+			room = RING_SIZE - at;
+		uint32_t part = size < room ? size : room;
+		memcpy(ring->data + at, data, part);
+		head += part;
+		data += part;
+		size -= part;
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&ring->posted, 1, __ATOMIC_RELEASE);
+		futex_wake(&ring->posted);
+	}
+}
+
+// waits until everything added has been written
+void ring_drain(Ring *ring) {
+	uint32_t tail;
+	while((tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) !=
+	      ring->head)
+		futex_wait(&ring->tail, tail);
+}
+
+// writes out the rest and stops the writer
+void ring_close(Ring *ring) {
+	__atomic_store_n(&ring->closing, true, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&ring->posted, 1, __ATOMIC_RELEASE);
+	futex_wake(&ring->posted);
+	pthread_join(ring->writer, NULL);
+	free(ring);
+}
+
+typedef struct {
+	int   outputSize;
+	int   outputFd;
+	bool  outputFailed, terminal;
+	// whether reading past the end of the input stops the run, which
+	// only a run counting apart does, see count_run
+	bool  endStops;
+	// the writer of --async-output, and whether it has output queued
+	Ring *ring;
+	bool  queued;
+	char *inputMap;
+	// the unread part of either the mapping or the input buffer
+	const char *inputStart, *inputEnd;
+	size_t      inputMapSize;
+	int         inputFd;
+	// the I/O of the caller of the library, used instead of the files
+	const BfvmIO *calls;
+	// statistics, time is the one spent inside the system calls
+	size_t bytesWritten, bytesRead;
+	double ioTime;
+	// last, so that resetting the rest does not touch them
+	char output[IO_BUFFER_SIZE];
+	char input[IO_BUFFER_SIZE];
+} IO;
+
+// Everything a running program owns: its tape and its I/O. A thread
+// runs one program at a time, in the VM vm points to, which is where the
+// interpreters, the native code of the JIT and AOT engines and the fault
+// handler find them. The compiled code is never written to, so any
+// number of VMs can run it at once.
+typedef struct {
+	char * memory;   // the first cell
+	size_t tapeSize; // bytes accessible from memory
+	char * tapeBase; // start of the reservation, the guard before memory
+	IO     io;
+	// where tape and limit errors go instead of exiting, if set
+	sigjmp_buf *escape;
+	// what is left of the limits of the run, see fuel_refill
+	long   stepsLeft; // beyond the fuel handed to the engine
+	long   slice;     // the most fuel handed out at once
+	size_t outputLeft;
+	double deadline; // on the clock of now(), 0 for none
+} VM;
+
+__thread VM *vm;
+
+void limit_abort(const char *reason);
+
+// opens the input of the program, stdin if filename is NULL, and sends
+// the output to outputFd. returns false if the file could not be opened.
+bool io_open(const char *filename, int outputFd) {
+	IO *io = &vm->io;
+	memset(io, 0, offsetof(IO, output));
+	io->inputFd  = STDIN_FILENO;
+	io->outputFd = outputFd;
+	io->terminal = isatty(outputFd);
+	// without a writer, the output is written right away
+	if(asyncOutput)
+		io->ring = ring_open(outputFd);
+	if(filename == NULL)
+		return true;
+	double start = now();
+	io->inputFd  = open(filename, O_RDONLY);
+	if(io->inputFd < 0)
+		return false;
+	struct stat st;
+	if(fstat(io->inputFd, &st) == 0 && S_ISREG(st.st_mode) &&
+	   st.st_size > 0) {
+		void *map =
+		    mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, io->inputFd, 0);
+		if(map != MAP_FAILED) {
+			io->inputMap     = (char *)map;
+			io->inputMapSize = st.st_size;
+			io->inputStart   = io->inputMap;
+			io->inputEnd     = io->inputMap + st.st_size;
+		}
+	}
+	io->ioTime += now() - start;
+	return true;
+}
+
+// takes the I/O of the program from the caller of the library
+void io_attach(const BfvmIO *calls) {
+	IO *io = &vm->io;
+	memset(io, 0, offsetof(IO, output));
+	io->inputFd = -1;
+	io->calls   = calls;
+	if(calls->input != NULL) {
+		io->inputStart = calls->input;
+		io->inputEnd   = calls->input + calls->inputSize;
+	}
+}
+
+// writes the pending output, or as much of it as the output limit
+// leaves, stopping the program if that is not all of it
+void io_flush() {
+	IO *   io    = &vm->io;
+	double start = now();
+	bool   over  = (size_t)io->outputSize > vm->outputLeft;
+	if(over)
+		io->outputSize = vm->outputLeft;
+	vm->outputLeft -= io->outputSize;
+	if(io->ring != NULL) {
+		ring_push(io->ring, io->output, io->outputSize);
+		io->queued = io->outputSize > 0;
+	} else if(io->calls != NULL) {
+		if(io->calls->write != NULL && io->outputSize > 0)
+			io->calls->write(io->calls->user, io->output, io->outputSize);
+	} else
+		for(int done = 0; done < io->outputSize;) {
+			ssize_t res =
+			    write(io->outputFd, io->output + done, io->outputSize - done);
+			if(res < 0 && errno == EINTR)
+				continue;
+			if(res < 0) {
+				output_failed(&io->outputFailed);
+				break;
+			}
+			done += res;
+		}
+	io->bytesWritten += io->outputSize;
+	io->outputSize = 0;
+	io->ioTime += now() - start;
+	if(over)
+		limit_abort("Error: output limit exceeded");
+}
+
+// waits for the output handed to the writer to be written
+void io_drain() {
+	IO *io = &vm->io;
+	if(io->queued)
+		ring_drain(io->ring);
+	io->queued = false;
+}
+
+void io_close() {
+	IO *io = &vm->io;
+	io_flush();
+	if(io->ring != NULL)
+		ring_close(io->ring);
+	io->ring   = NULL;
+	io->queued = false;
+	if(io->inputMap != NULL)
+		munmap(io->inputMap, io->inputMapSize);
+	if(io->inputFd != STDIN_FILENO && io->inputFd >= 0)
+		close(io->inputFd);
+}
+
+static inline void io_put(char c) {
+	IO *io = &vm->io;
+	if(io->outputSize == IO_BUFFER_SIZE)
+		io_flush();
+	io->output[io->outputSize++] = c;
+	if(io->terminal &&
+	   (c == '\n' || io->outputSize >= TERMINAL_BUFFER_SIZE))
+		io_flush();
+#ifdef DEBUG
+	// keep the output in order with the trace
+	fflush(stdout);
+	io_flush();
+	io_drain();
+#endif
+}
+
+// waits for input on the file of the program until the deadline,
+// returns false if it passed first
+bool io_wait(double deadline) {
+	struct pollfd input = {vm->io.inputFd, POLLIN, 0};
+	for(double left; (left = deadline - now()) > 0;) {
+		int ready = poll(&input, 1, (int)(left * 1000) + 1);
+		// errors are for read to report
+		if(ready > 0 || (ready < 0 && errno != EINTR))
+			return true;
+	}
+	return false;
+}
+
+int io_end() {
+	if(vm->io.endStops)
+		siglongjmp(*vm->escape, 1);
+	return EOF;
+}
+
+// reads the next byte of input, returns EOF at the end of it. pending
+// output is written first, so prompts show up before input is waited on.
+int io_refill() {
+	IO *io = &vm->io;
+	if(io->outputSize > 0)
+		io_flush();
+	io_drain();
+	if(io->inputStart < io->inputEnd)
+		return (unsigned char)*io->inputStart++;
+	// a mapping or a buffer given by the caller is all there is
+	if(io->inputMap != NULL ||
+	   (io->calls != NULL && (io->calls->input || !io->calls->read)))
+		return io_end();
+	// a program waiting for input is still running
+	if(io->calls == NULL && vm->deadline > 0 && !io_wait(vm->deadline))
+		limit_abort("Error: time limit exceeded");
+	double  start = now();
+	ssize_t res   = io->calls != NULL
+	                  ? (ssize_t)io->calls->read(io->calls->user, io->input,
+	                                             IO_BUFFER_SIZE)
+	                  : read(io->inputFd, io->input, IO_BUFFER_SIZE);
+	io->ioTime += now() - start;
+	if(res <= 0)
+		return io_end();
+	io->bytesRead += res;
+	io->inputStart = io->input;
+	io->inputEnd   = io->input + res;
+	return (unsigned char)*io->inputStart++;
+}
+
+static inline int io_get() {
+	IO *io = &vm->io;
+	if(io->outputSize > 0 || io->queued || io->inputStart == io->inputEnd)
+		return io_refill();
+	return (unsigned char)*io->inputStart++;
+}
+
+// out of line versions for the JIT
+void io_write_byte(int c) {
+	io_put(c);
+}
+
+int io_read_byte() {
+	return io_get();
+}
+
+// the bytes of input the program has read so far
+size_t io_consumed() {
+	IO *io = &vm->io;
+	if(io->inputMap != NULL)
+		return io->inputStart - io->inputMap;
+	return io->bytesRead - (io->inputEnd - io->inputStart);
+}
+
+// drops the next count bytes of input, which a resumed run read before
+void io_skip(size_t count) {
+	IO *io = &vm->io;
+	if(io->inputMap != NULL) {
+		size_t left    = io->inputEnd - io->inputStart;
+		io->inputStart += count < left ? count : left;
+		return;
+	}
+	while(count > 0 && io_refill() != EOF) count--;
+}
+
+void io_print_stats(double elapsed) {
+	IO *io = &vm->io;
+	if(io->inputMap != NULL)
+		io->bytesRead = io->inputStart - io->inputMap;
+	size_t total = io->bytesWritten + io->bytesRead;
+	fprintf(stderr,
+	        "I/O: %zu bytes written, %zu bytes read, %fs in I/O (%.2f MB/s), "
+	        "%fs compute\n",
+	        io->bytesWritten, io->bytesRead, io->ioTime,
+	        io->ioTime > 0 ? total / io->ioTime / 1e6 : 0.0,
+	        elapsed - io->ioTime);
+}
+
+// Hardware counters for --perf, counted over compiling and running the
+// program separately, in all the threads of the process. Containers
+// often do not permit perf_event_open, and virtual machines may have no
+// counters to give, in which case only the times are reported.
+#define HW_CACHE_MISS(cache)                                          \
+	((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 |                     \
+	 PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_L1I_MISSES,
+	PERF_COUNTERS
+};
+
+const struct {
+	const char *name;
+	uint32_t    type;
+	uint64_t    config;
+} perfEvents[PERF_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1-dcache-misses", PERF_TYPE_HW_CACHE,
+     HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"L1-icache-misses", PERF_TYPE_HW_CACHE,
+     HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1I)},
+};
+
+typedef struct {
+	int    fds[PERF_COUNTERS]; // -1 for the counters not available
+	int    error;              // why the first of those is not
+	double counts[PERF_COUNTERS];
+	double wall, cpu; // the clocks at the start, then the seconds spent
+} PerfPhase;
+
+double cpu_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void perf_start(PerfPhase *phase) {
+	memset(phase, 0, sizeof(*phase));
+	for(int i = 0; i < PERF_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size           = sizeof(attr);
+		attr.type           = perfEvents[i].type;
+		attr.config         = perfEvents[i].config;
+		attr.disabled       = 1;
+		attr.inherit        = 1; // the threads started in the phase
+		attr.exclude_kernel = 1; // all that unprivileged users may count
+		attr.exclude_hv     = 1;
+		attr.read_format =
+		    PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		phase->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if(phase->fds[i] < 0 && phase->error == 0)
+			phase->error = errno;
+	}
+	phase->wall = now();
+	phase->cpu  = cpu_time();
+	for(int i = 0; i < PERF_COUNTERS; i++)
+		if(phase->fds[i] >= 0)
+			ioctl(phase->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+}
+
+void perf_stop(PerfPhase *phase) {
+	for(int i = 0; i < PERF_COUNTERS; i++)
+		if(phase->fds[i] >= 0)
+			ioctl(phase->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	phase->wall = now() - phase->wall;
+	phase->cpu  = cpu_time() - phase->cpu;
+	for(int i = 0; i < PERF_COUNTERS; i++) {
+		// value, time enabled and time running, the counters sharing the
+		// hardware with others only count part of the time
+		uint64_t values[3];
+		if(phase->fds[i] < 0)
+			continue;
+		bool counted =
+		    read(phase->fds[i], values, sizeof(values)) == sizeof(values) &&
+		    values[2] > 0;
+		close(phase->fds[i]);
+		if(counted)
+			phase->counts[i] = (double)values[0] * values[1] / values[2];
+		else
+			phase->fds[i] = -1;
+	}
+}
+
+// prints the counters of the phase with their ratios, branch misses per
+// 1000 dispatches when they were counted with --count-ops, by the run or
+// apart from it, or else per 1000 instructions
+void perf_print(const char *name, PerfPhase *phase, uint64_t ops) {
+	double *counts = phase->counts;
+	bool    found  = false;
+	fprintf(stderr, "Perf %s: %fs cpu, %fs wall", name, phase->cpu,
+	        phase->wall);
+	for(int i = 0; i < PERF_COUNTERS; i++) {
+		if(phase->fds[i] < 0)
+			continue;
+		fprintf(stderr, ", %.0f %s", counts[i], perfEvents[i].name);
+		found = true;
+	}
+	if(!found) {
+		fprintf(stderr, ", no hardware counters (%s)\n",
+		        strerror(phase->error));
+		return;
+	}
+	bool cycles       = phase->fds[PERF_CYCLES] >= 0 && counts[PERF_CYCLES];
+	bool instructions = phase->fds[PERF_INSTRUCTIONS] >= 0;
+	if(cycles && instructions)
+		fprintf(stderr, ", %.2f IPC",
+		        counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+	if(phase->fds[PERF_BRANCH_MISSES] >= 0 && ops > 0)
+		fprintf(stderr, ", %.2f branch-misses per 1000 ops",
+		        counts[PERF_BRANCH_MISSES] * 1000 / ops);
+	else if(phase->fds[PERF_BRANCH_MISSES] >= 0 && instructions &&
+	        counts[PERF_INSTRUCTIONS])
+		fprintf(stderr, ", %.2f branch-misses per 1000 instructions",
+		        counts[PERF_BRANCH_MISSES] * 1000 / counts[PERF_INSTRUCTIONS]);
+	fprintf(stderr, "\n");
+}
+
+// The tape is a reserved range of address space, of which only the
+// first tapeSize bytes are accessible. Everything around it is mapped
+// PROT_NONE, so the hot loop needs no bounds checks: touching the
+// inaccessible part to the right grows the tape from the SIGSEGV
+// handler, and touching the guard on the left (or going past the
+// reserve) stops the program with the offending cell index. The signal
+// is delivered to the faulting thread, so vm is the VM that faulted.
+#define TAPE_GUARD (1 << 20)
+#define TAPE_RESERVE (1ul << 30)
+#define TAPE_ERROR 3
+
+_Static_assert((REACH_MAX + RANGE_MAX) * sizeof(uint32_t) < TAPE_GUARD,
+               "an access can jump over the guard");
+
+// writes "msg index\n" without stdio, as it is called from the handler.
+// the library only returns TAPE_ERROR.
+void tape_report(const char *msg, long index) {
+#ifdef BFVM_LIBRARY
+	(void)msg;
+	(void)index;
+#else
+	char  buf[96], digits[24];
+	int   len = 0, count = 0;
+	bool  neg = index < 0;
+	unsigned long value = neg ? -(unsigned long)index : (unsigned long)index;
+	while(*msg) buf[len++] = *msg++;
+	if(neg)
+		buf[len++] = '-';
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while(value);
+	while(count) buf[len++] = digits[--count];
+	buf[len++] = '\n';
+	if(write(STDERR_FILENO, buf, len) < 0)
+		return;
+#endif
+}
+
+// flushes the output of the program and stops it
+void tape_abort() {
+	io_flush();
+	io_drain();
+	if(vm->escape != NULL)
+		siglongjmp(*vm->escape, TAPE_ERROR);
+	_exit(TAPE_ERROR);
+}
+
+// Limits for running untrusted programs. The engines spend a step of
+// fuel on every jump back to the start of a loop, as nothing else runs
+// for long, and keep the fuel in a local the hot loop only counts down.
+// Once it runs out, fuel_refill looks at the clock and hands out the
+// next slice of the steps left. Output is counted as it is flushed, and
+// waiting for input counts against the deadline.
+#define LIMIT_ERROR 4
+// steps between two looks at the clock
+#define FUEL_SLICE (1l << 20)
+
+// the limits of the runs of main, 0 for none
+BfvmLimits runLimits;
+
+// arms the limits for the next run in machine
+void vm_limit(VM *machine, const BfvmLimits *limits) {
+	machine->stepsLeft = limits->steps > 0 && limits->steps < LONG_MAX
+	                         ? (long)limits->steps
+	                         : LONG_MAX;
+	machine->outputLeft = limits->output > 0 ? limits->output : SIZE_MAX;
+	machine->deadline   = limits->seconds > 0 ? now() + limits->seconds : 0;
+	machine->slice      = machine->deadline > 0 ? FUEL_SLICE : LONG_MAX;
+}
+
+// flushes the output the limits allow and stops the program. the
+// library only returns LIMIT_ERROR.
+void limit_abort(const char *reason) {
+	io_flush();
+	io_drain();
+#ifdef BFVM_LIBRARY
+	(void)reason;
+#else
+	fprintf(stderr, "%s\n", reason);
+#endif
+	if(vm->escape != NULL)
+		siglongjmp(*vm->escape, LIMIT_ERROR);
+	_exit(LIMIT_ERROR);
+}
+
+// called by an engine out of fuel, for the step it is about to take.
+// returns the fuel left of the next slice after that step.
+long fuel_refill() {
+	if(vm->deadline > 0 && now() > vm->deadline)
+		limit_abort("Error: time limit exceeded");
+	if(vm->stepsLeft == 0)
+		limit_abort("Error: step limit exceeded");
+	long slice = vm->slice;
+	if(slice > vm->stepsLeft)
+		slice = vm->stepsLeft;
+	vm->stepsLeft -= slice;
+	return slice - 1;
+}
+
+// the handlers in place before ours, which get the faults that are not
+// on a tape, as the program embedding the library may have its own
+struct sigaction previousSegv, previousBus;
+
+void tape_pass(int sig, siginfo_t *info, void *context) {
+	struct sigaction *previous = sig == SIGSEGV ? &previousSegv : &previousBus;
+	if(previous->sa_flags & SA_SIGINFO)
+		previous->sa_sigaction(sig, info, context);
+	else if(previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN)
+		previous->sa_handler(sig);
+	else
+		// crash as usual
+		signal(sig, SIG_DFL);
+}
+
+void tape_fault(int sig, siginfo_t *info, void *context) {
+	char *addr = (char *)info->si_addr;
+	if(vm == NULL || addr < vm->tapeBase ||
+	   addr >= vm->memory + TAPE_RESERVE + TAPE_GUARD) {
+		tape_pass(sig, info, context);
+		return;
+	}
+	char * memory   = vm->memory;
+	size_t tapeSize = vm->tapeSize;
+	if(addr >= memory + tapeSize && addr < memory + TAPE_RESERVE) {
+		// double the tape until it covers the fault, and retry
+		size_t size = tapeSize;
+		while(memory + size <= addr) size *= 2;
+		if(size > TAPE_RESERVE)
+			size = TAPE_RESERVE;
+		if(mprotect(memory + tapeSize, size - tapeSize,
+		            PROT_READ | PROT_WRITE) == 0) {
+			vm->tapeSize = size;
+			return;
+		}
+	}
+	// the cell holding the byte
+	long size  = cellBits / 8;
+	long index = addr >= memory ? (addr - memory) / size
+	                            : -((memory - addr + size - 1) / size);
+	if(addr < memory) {
+		tape_report("Error: moved left of the first cell, cell index ", index);
+		tape_abort();
+	}
+	if(addr >= memory + tapeSize) {
+		tape_report("Error: out of tape memory, cell index ", index);
+		tape_abort();
+	}
+	tape_pass(sig, info, context);
+}
+
+// installs the handler, once for all the VMs
+bool tape_init() {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = tape_fault;
+	sa.sa_flags     = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	return sigaction(SIGSEGV, &sa, &previousSegv) == 0 &&
+	       sigaction(SIGBUS, &sa, &previousBus) == 0;
+}
+
+// reserves the tape of the VM and commits the first cells
+bool tape_map(VM *machine) {
+	size_t total = TAPE_GUARD + TAPE_RESERVE + TAPE_GUARD;
+	void * base  = mmap(NULL, total, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(base == MAP_FAILED)
+		return false;
+	machine->tapeBase = (char *)base;
+	machine->memory   = machine->tapeBase + TAPE_GUARD;
+	machine->tapeSize = TAPE_CELLS * (cellBits / 8);
+	return mprotect(machine->memory, machine->tapeSize,
+	                PROT_READ | PROT_WRITE) == 0;
+}
+
+// returns a VM with a fresh tape, or NULL if there is no room for one
+VM *vm_new() {
+	VM *machine = (VM *)calloc(1, sizeof(VM));
+	if(machine != NULL && !tape_map(machine)) {
+		if(machine->tapeBase != NULL)
+			munmap(machine->tapeBase, TAPE_GUARD + TAPE_RESERVE + TAPE_GUARD);
+		free(machine);
+		return NULL;
+	}
+	if(machine != NULL)
+		vm_limit(machine, &(BfvmLimits){0});
+	return machine;
+}
+
+void vm_free(VM *machine) {
+	munmap(machine->tapeBase, TAPE_GUARD + TAPE_RESERVE + TAPE_GUARD);
+	free(machine);
+}
+
+// Kernels for SCAN_LEFT/SCAN_RIGHT, which move to the nearest zero cell
+// a multiple of stride away. The fast paths only look at memory inside
+// the tape and finish with the plain loop, so running off the tape
+// behaves exactly like the loop being replaced.
+typedef char *(*ScanKernel)(char *cell, int stride);
+
+char *scan_right_scalar(char *cell, int stride) {
+	while(*cell) cell += stride;
+	return cell;
+}
+
+char *scan_left_scalar(char *cell, int stride) {
+	while(*cell) cell -= stride;
+	return cell;
+}
+
+char *scan_right_memchr(char *cell, int stride) {
+	char *end = vm->memory + vm->tapeSize;
+	if(cell >= vm->memory && cell < end) {
+		char *found = (char *)memchr(cell, 0, end - cell);
+		if(found)
+			return found;
+	}
+	return scan_right_scalar(cell, stride);
+}
+
+char *scan_left_memrchr(char *cell, int stride) {
+#ifdef __GLIBC__
+	if(cell >= vm->memory && cell < vm->memory + vm->tapeSize) {
+		char *found = (char *)memrchr(vm->memory, 0, cell - vm->memory + 1);
+		if(found)
+			return found;
+	}
+#endif
+	return scan_left_scalar(cell, stride);
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define BFVM_SIMD
+
+// lanes 0, stride, 2 * stride.. of a block, the present cell being lane 0
+uint32_t scan_pattern_right(int stride, int width) {
+	uint32_t pattern = 0;
+	for(int i = 0; i < width; i += stride) pattern |= 1u << i;
+	return pattern;
+}
+
+// lanes width - 1, width - 1 - stride.. of a block, the present cell
+// being the last lane
+uint32_t scan_pattern_left(int stride, int width) {
+	uint32_t pattern = 0;
+	for(int i = width - 1; i >= 0; i -= stride) pattern |= 1u << i;
+	return pattern;
+}
+
+// distance to the first multiple of stride not covered by a block
+#define SCAN_STEP(stride, width) ((((width)-1) / (stride) + 1) * (stride))
+
+#define SCAN_KERNELS(isa, width, vtype, load, cmpeq, movemask, zero)          \
+	__attribute__((target(#isa))) char *scan_right_##isa(char *cell,         \
+	                                                    int   stride) {      \
+		uint32_t pattern = scan_pattern_right(stride, width);                 \
+		int      step    = SCAN_STEP(stride, width);                          \
+		vtype    zeroes  = zero();                                            \
+		char *   start = vm->memory, *end = start + vm->tapeSize;             \
+		while(cell >= start && cell + width <= end) {                         \
+			uint32_t found =                                                  \
+			    (uint32_t)movemask(cmpeq(load((vtype *)cell), zeroes)) &      \
+			    pattern;                                                      \
+			if(found)                                                         \
+				return cell + __builtin_ctz(found);                           \
+			cell += step;                                                     \
+		}                                                                     \
+		return scan_right_scalar(cell, stride);                               \
+	}                                                                         \
+	__attribute__((target(#isa))) char *scan_left_##isa(char *cell,          \
+	                                                   int   stride) {       \
+		uint32_t pattern = scan_pattern_left(stride, width);                  \
+		int      step    = SCAN_STEP(stride, width);                          \
+		vtype    zeroes  = zero();                                            \
+		char *   start = vm->memory, *end = start + vm->tapeSize;             \
+		while(cell - (width - 1) >= start && cell < end) {                    \
+			char *   block = cell - (width - 1);                              \
+			uint32_t found =                                                  \
+			    (uint32_t)movemask(cmpeq(load((vtype *)block), zeroes)) &     \
+			    pattern;                                                      \
+			if(found)                                                         \
+				return block + 31 - __builtin_clz(found);                     \
+			cell -= step;                                                     \
+		}                                                                     \
+		return scan_left_scalar(cell, stride);                                \
+	}
+
+SCAN_KERNELS(sse2, 16, __m128i, _mm_loadu_si128, _mm_cmpeq_epi8,
+             _mm_movemask_epi8, _mm_setzero_si128);
+SCAN_KERNELS(avx2, 32, __m256i, _mm256_loadu_si256, _mm256_cmpeq_epi8,
+             _mm256_movemask_epi8, _mm256_setzero_si256);
+#endif
+
+ScanKernel scan_right_strided = scan_right_scalar;
+ScanKernel scan_left_strided  = scan_left_scalar;
+
+
+char *scan_right(char *cell, int stride) {
+	if(stride == 1)
+		return scan_right_memchr(cell, stride);
+	if(stride <= 8)
+		return scan_right_strided(cell, stride);
+	return scan_right_scalar(cell, stride);
+}
+
+char *scan_left(char *cell, int stride) {
+	if(stride == 1)
+		return scan_left_memrchr(cell, stride);
+	if(stride <= 8)
+		return scan_left_strided(cell, stride);
+	return scan_left_scalar(cell, stride);
+}
+
+static inline uint8_t *scan_right_8(uint8_t *cell, int stride) {
+	return (uint8_t *)scan_right((char *)cell, stride);
+}
+
+static inline uint8_t *scan_left_8(uint8_t *cell, int stride) {
+	return (uint8_t *)scan_left((char *)cell, stride);
+}
+
+// the kernels look for zero bytes, wider cells take the plain loop
+#define SCAN_WIDE(bits)                                                  \
+	uint##bits##_t *scan_right_##bits(uint##bits##_t *cell, int stride) { \
+		while(*cell) cell += stride;                                      \
+		return cell;                                                      \
+	}                                                                     \
+	uint##bits##_t *scan_left_##bits(uint##bits##_t *cell, int stride) {  \
+		while(*cell) cell -= stride;                                      \
+		return cell;                                                      \
+	}
+
+SCAN_WIDE(16)
+SCAN_WIDE(32)
+
+// Kernels for ADD_RANGE and MUL_RANGE, which add times the values of a
+// window to the cells from cell on. the values are cells, packed in the
+// operands, so neither they nor the cells need be aligned.
+typedef void (*RangeKernel)(void *cell, const void *values, int count,
+                            uint32_t times);
+
+#define RANGE_SCALAR(bits)                                                 \
+	void range_scalar_##bits(void *cell, const void *values, int count,    \
+	                         uint32_t times) {                             \
+		uint##bits##_t *cells = (uint##bits##_t *)cell, value;             \
+		for(int i = 0; i < count; i++) {                                   \
+			memcpy(&value, (const char *)values + i * sizeof(value),       \
+			       sizeof(value));                                         \
+			cells[i] += value * times;                                     \
+		}                                                                  \
+	}
+
+RANGE_SCALAR(8)
+RANGE_SCALAR(16)
+RANGE_SCALAR(32)
+
+#ifdef BFVM_SIMD
+// adds the lanes of one vector of type at i, while they fit in the window
+#define RANGE_VECTOR(type, bits)                                            \
+	for(type cells, window; i + (int)(sizeof(type) / (bits / 8)) <= count; \
+	    i += sizeof(type) / (bits / 8)) {                                   \
+		memcpy(&cells, (char *)cell + i * (bits / 8), sizeof(type));        \
+		memcpy(&window, (const char *)values + i * (bits / 8),              \
+		       sizeof(type));                                               \
+		cells += window * (uint##bits##_t)times;                            \
+		memcpy((char *)cell + i * (bits / 8), &cells, sizeof(cells));       \
+	}
+
+// whole vectors of width bytes, then a half one, then single cells
+#define RANGE_KERNEL(isa, bits, width)                                       \
+	typedef uint##bits##_t vector_##isa##_##bits                             \
+	    __attribute__((vector_size(width)));                                 \
+	typedef uint##bits##_t half_##isa##_##bits                               \
+	    __attribute__((vector_size(width / 2)));                             \
+	__attribute__((target(#isa))) void range_##isa##_##bits(                 \
+	    void *cell, const void *values, int count, uint32_t times) {         \
+		int i = 0;                                                           \
+		RANGE_VECTOR(vector_##isa##_##bits, bits)                            \
+		RANGE_VECTOR(half_##isa##_##bits, bits)                              \
+		range_scalar_##bits((char *)cell + i * (bits / 8),                   \
+		                    (const char *)values + i * (bits / 8), count - i, \
+		                    times);                                          \
+	}
+
+RANGE_KERNEL(sse2, 8, 16)
+RANGE_KERNEL(sse2, 16, 16)
+RANGE_KERNEL(sse2, 32, 16)
+RANGE_KERNEL(avx2, 8, 32)
+RANGE_KERNEL(avx2, 16, 32)
+RANGE_KERNEL(avx2, 32, 32)
+#endif
+
+RangeKernel rangeKernels[CELL_WIDTHS] = {range_scalar_8, range_scalar_16,
+                                         range_scalar_32};
+
+// picks the widest kernels the cpu supports
+void kernels_init() {
+#ifdef BFVM_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		scan_right_strided = scan_right_avx2;
+		scan_left_strided  = scan_left_avx2;
+		rangeKernels[0]    = range_avx2_8;
+		rangeKernels[1]    = range_avx2_16;
+		rangeKernels[2]    = range_avx2_32;
+	} else {
+		scan_right_strided = scan_right_sse2;
+		scan_left_strided  = scan_left_sse2;
+		rangeKernels[0]    = range_sse2_8;
+		rangeKernels[1]    = range_sse2_16;
+		rangeKernels[2]    = range_sse2_32;
+	}
+#endif
+}
+
+#ifndef DEBUG
+#define BFVM_COMPUTED_GOTO
+#endif
+
+#define SPECIALIZED8_SINGLE_INS(name, x, op, num) \
+	CASE(name##_##num) : {                        \
+		x op## = num;                             \
+		DISPATCH();                               \
+	}
+#define SPECIALIZED8_INS_X(name, x, op) \
+	CASE(name##_X) : {                  \
+		x op## = next_code();           \
+		DISPATCH();                     \
+	}
+#define SPECIALIZED8_IMPL(name, x, op)       \
+	SPECIALIZED8_SINGLE_INS(name, x, op, 1); \
+	SPECIALIZED8_SINGLE_INS(name, x, op, 2); \
+	SPECIALIZED8_SINGLE_INS(name, x, op, 3); \
+	SPECIALIZED8_SINGLE_INS(name, x, op, 4); \
+	SPECIALIZED8_SINGLE_INS(name, x, op, 5); \
+	SPECIALIZED8_SINGLE_INS(name, x, op, 6); \
+	SPECIALIZED8_SINGLE_INS(name, x, op, 7); \
+	SPECIALIZED8_SINGLE_INS(name, x, op, 8); \
+	SPECIALIZED8_INS_X(name, x, op);
+
+#define SPECIALIZED8_LABEL(name, x) &&LABEL_##name##_##x
+#define SPECIALIZED8_GOTO(x)                                \
+	SPECIALIZED8_LABEL(x, 1), SPECIALIZED8_LABEL(x, 2),     \
+	    SPECIALIZED8_LABEL(x, 3), SPECIALIZED8_LABEL(x, 4), \
+	    SPECIALIZED8_LABEL(x, 5), SPECIALIZED8_LABEL(x, 6), \
+	    SPECIALIZED8_LABEL(x, 7), SPECIALIZED8_LABEL(x, 8), &&LABEL_##x##_X
+
+// the function of an engine for the cells and end of input behaviour
+#define VARIANT_OF(name, bits, eof) name##_variants[CELL_INDEX(bits)][eof]
+
+// the plain encoding, where every opcode and operand is an int
+#define EXECUTE_NAME execute_ints
+#define CODE_TYPE int
+#define next_op() (*(code++))
+#define next_code() (*(code++))
+#define skip_code(n) (code += (n))
+#define TRACE() disassemble_single(code - start, (int *)code)
+#include "execute_variants.h"
+
+// the same loop dispatching through a switch, like DEBUG builds do
+#ifdef BFVM_COMPUTED_GOTO
+#undef EXECUTE_NAME
+#define EXECUTE_NAME execute_switch
+#undef BFVM_COMPUTED_GOTO
+#include "execute_variants.h"
+#define BFVM_COMPUTED_GOTO
+#else
+#define execute_switch_variants execute_ints_variants
+#endif
+
+// and once more counting the executed instructions, for benchmarks
+uint64_t executedOps = 0;
+#undef EXECUTE_NAME
+#define EXECUTE_NAME execute_counted
+#define COUNT_OP() (executedOps++)
+#include "execute_variants.h"
+#undef COUNT_OP
+
+// and recording the sequences of instructions, for --ngrams
+#undef EXECUTE_NAME
+#define EXECUTE_NAME execute_ngrams
+#define COUNT_OP() ngram_record(*code)
+#include "execute_variants.h"
+#undef COUNT_OP
+
+// and stopping with a checkpoint whenever one is due, see --checkpoint.
+// it starts at the cell resumeCell.
+long resumeCell;
+void checkpoint_poll(const int *code, void *cell);
+#undef EXECUTE_NAME
+#define EXECUTE_NAME execute_resumable
+#define START_CELL() ((CELL *)vm->memory + resumeCell)
+#define CHECKPOINT() checkpoint_poll(code, cell)
+#include "execute_variants.h"
+#undef START_CELL
+#undef CHECKPOINT
+
+// and counting the executions of every address, for the profiler
+const int *profileStart;
+#undef EXECUTE_NAME
+#define EXECUTE_NAME execute_profiled_code
+#define COUNT_OP() (profile.counts[code - profileStart]++)
+#include "execute_variants.h"
+#undef COUNT_OP
+#undef EXECUTE_NAME
+#undef CODE_TYPE
+#undef next_op
+#undef next_code
+#undef skip_code
+#undef TRACE
+
+// the compact encoding
+#define EXECUTE_NAME execute_compact
+#define CODE_TYPE Byte
+#define next_op() (*(code++))
+#define next_code() read_operand(&code)
+#define skip_code(n) skip_operands(&code, n)
+#define TRACE() disassemble_compact(code - start, code)
+#include "execute_variants.h"
+#undef EXECUTE_NAME
+#undef CODE_TYPE
+#undef next_op
+#undef next_code
+#undef skip_code
+#undef TRACE
+
+// Direct threading: every opcode is replaced by the address of its
+// handler, so dispatching is a single load and an indirect jump. The
+// layout is the same as the int encoding, so are the jump offsets.
+#ifdef BFVM_COMPUTED_GOTO
+void *threadedLabels[CELL_WIDTHS][EOF_MODES][OPCODE_COUNT];
+
+#define EXECUTE_NAME execute_threaded_code
+#define CODE_TYPE intptr_t
+#define next_target() ((void *)*(code++))
+#define next_code() ((int)*(code++))
+#define skip_code(n) (code += (n))
+#define EXPORT_LABELS(table)                                               \
+	memcpy(threadedLabels[CELL_INDEX(CELL_BITS)][EOF_MODE], table, \
+	       sizeof(table))
+#include "execute_variants.h"
+#undef EXECUTE_NAME
+#undef CODE_TYPE
+#undef next_target
+#undef next_code
+#undef skip_code
+#undef EXPORT_LABELS
+
+intptr_t *thread_code(IntArray *program, int bits, int eof) {
+	void **labels = threadedLabels[CELL_INDEX(bits)][eof];
+	// the handler addresses are only known inside the loop itself
+	if(labels[START] == NULL)
+		VARIANT_OF(execute_threaded_code, bits, eof)(NULL);
+	int *     code     = program->values;
+	intptr_t *threaded = (intptr_t *)malloc(sizeof(intptr_t) * program->size);
+	for(int ip = 0; ip < program->size;) {
+		int length   = instruction_length(&code[ip]);
+		threaded[ip] = (intptr_t)labels[code[ip]];
+		for(int i = 1; i < length; i++) threaded[ip + i] = code[ip + i];
+		ip += length;
+	}
+	return threaded;
+}
+#endif
+
+// the profiler only runs the program of the command line
+void execute_profiled(IntArray *program) {
+	profile.counts = (uint64_t *)calloc(program->size, sizeof(uint64_t));
+	profileStart   = program->values;
+	VARIANT_OF(execute_profiled_code, cellBits, eofMode)(program->values);
+}
+
+// FNV-1a, to tell whether a saved profile belongs to the source
+uint64_t hash_source(const char *source, size_t length) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)source[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// identifies the build of bfvm, for anything saved that depends on it
+uint64_t build_hash() {
+	const char *build = __DATE__ " " __TIME__;
+	return hash_source(build, strlen(build));
+}
+
+// collects the trip counts of the loops of a profiled run
+void profile_loops(IntArray *program) {
+	int *code = program->values;
+	LoopProfile_array_init(&profile.loops);
+	for(int ip = 0; ip < program->size; ip += instruction_length(&code[ip])) {
+		if(code[ip] != JMPZ)
+			continue;
+		// the loop ends with the JMPNZ at ip + code[ip + 1]
+		LoopProfile loop = {profile.sourceMap.values[ip], profile.counts[ip],
+		                    profile.counts[ip + code[ip + 1]]};
+		LoopProfile_array_insert(&profile.loops, loop);
+	}
+}
+
+bool profile_save(const char *filename, uint64_t hash) {
+	FILE *f = fopen(filename, "w");
+	if(f == NULL)
+		return false;
+	fprintf(f, "bfvm-profile 1 %016llx\n", (unsigned long long)hash);
+	for(int i = 0; i < profile.loops.size; i++) {
+		LoopProfile *loop = &profile.loops.values[i];
+		fprintf(f, "%d %llu %llu\n", loop->offset,
+		        (unsigned long long)loop->entries,
+		        (unsigned long long)loop->iterations);
+	}
+	return fclose(f) == 0;
+}
+
+// loads the loops of a saved profile, ignoring it if it was made for a
+// different source
+bool profile_load(const char *filename, uint64_t hash) {
+	FILE *f = fopen(filename, "r");
+	if(f == NULL)
+		return false;
+	unsigned long long saved, entries, iterations;
+	int                version, offset;
+	LoopProfile_array_init(&profile.loops);
+	if(fscanf(f, "bfvm-profile %d %llx", &version, &saved) != 2 ||
+	   version != 1 || saved != hash) {
+		fclose(f);
+		return false;
+	}
+	while(fscanf(f, "%d %llu %llu", &offset, &entries, &iterations) == 3) {
+		LoopProfile loop = {offset, entries, iterations};
+		LoopProfile_array_insert(&profile.loops, loop);
+	}
+	fclose(f);
+	return true;
+}
+
+#define PROFILE_HOT_LOOPS 10
+
+// prints the loops that run the most instructions, each with the
+// instructions executed inside it, nested loops included
+void profile_report(IntArray *program) {
+	int *    code  = program->values;
+	uint64_t total = 0;
+	for(int ip = 0; ip < program->size; ip++) total += profile.counts[ip];
+	uint64_t *inside = (uint64_t *)calloc(profile.loops.size, sizeof(uint64_t));
+	for(int ip = 0, l = 0; ip < program->size;
+	    ip += instruction_length(&code[ip])) {
+		if(code[ip] != JMPZ)
+			continue;
+		for(int i = ip; i <= ip + code[ip + 1]; i++)
+			inside[l] += profile.counts[i];
+		l++;
+	}
+	fprintf(stderr, "Profile: %llu instructions executed\n",
+	        (unsigned long long)total);
+	fprintf(stderr, "%10s %14s %14s %10s %8s\n", "offset", "entries",
+	        "iterations", "avg trip", "share");
+	for(int n = 0; n < PROFILE_HOT_LOOPS; n++) {
+		int hottest = -1;
+		for(int i = 0; i < profile.loops.size; i++)
+			if(inside[i] > 0 && (hottest == -1 || inside[i] > inside[hottest]))
+				hottest = i;
+		if(hottest == -1)
+			break;
+		LoopProfile *loop = &profile.loops.values[hottest];
+		fprintf(stderr, "%10d %14llu %14llu %10.1f %7.2f%%\n", loop->offset,
+		        (unsigned long long)loop->entries,
+		        (unsigned long long)loop->iterations,
+		        loop->entries ? (double)loop->iterations / loop->entries : 0,
+		        100.0 * inside[hottest] / total);
+		inside[hottest] = 0;
+	}
+	free(inside);
+}
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define BFVM_JIT
+#endif
+
+#ifdef BFVM_JIT
+// The native code keeps the cell pointer in rbx, which is callee saved,
+// so the I/O layer and the scan kernels can be called directly.
+typedef void (*NativeCode)(char *cell);
+
+// the scan kernels for each width of the cells
+void *const scanRights[CELL_WIDTHS] = {
+    (void *)scan_right, (void *)scan_right_16, (void *)scan_right_32};
+void *const scanLefts[CELL_WIDTHS] = {(void *)scan_left, (void *)scan_left_16,
+                                      (void *)scan_left_32};
+
+void jit_emit(ByteArray *native, const char *bytes, int count) {
+	for(int i = 0; i < count; i++) Byte_array_insert(native, bytes[i]);
+}
+
+void jit_emit32(ByteArray *native, int32_t value) {
+	jit_emit(native, (const char *)&value, 4);
+}
+
+void jit_emit_call(ByteArray *native, void *function) {
+	uint64_t address = (uint64_t)(uintptr_t)function;
+	jit_emit(native, "\x48\xB8", 2); // mov rax, imm64
+	jit_emit(native, (const char *)&address, 8);
+	jit_emit(native, "\xFF\xD0", 2); // call rax
+}
+
+// emits the opcode of an instruction on a cell of the given size, op8
+// for bytes and op for wider cells, which the 66 prefix makes 16 bit,
+// followed by its modrm byte
+void jit_cell_op(ByteArray *native, int size, int op8, int op, int modrm) {
+	if(size == 2)
+		Byte_array_insert(native, 0x66);
+	Byte_array_insert(native, size == 1 ? op8 : op);
+	Byte_array_insert(native, modrm);
+}
+
+// emits an immediate the size of a cell
+void jit_cell_imm(ByteArray *native, int size, int32_t value) {
+	jit_emit(native, (const char *)&value, size);
+}
+
+void jit_incr(ByteArray *native, int size, int count) {
+	jit_cell_op(native, size, 0x80, 0x81, 0x03); // add [rbx], imm
+	jit_cell_imm(native, size, count);
+}
+
+void jit_decr(ByteArray *native, int size, int count) {
+	jit_cell_op(native, size, 0x80, 0x81, 0x2B); // sub [rbx], imm
+	jit_cell_imm(native, size, count);
+}
+
+void jit_right(ByteArray *native, int size, int count) {
+	jit_emit(native, "\x48\x81\xC3", 3); // add rbx, imm32
+	jit_emit32(native, count * size);
+}
+
+void jit_left(ByteArray *native, int size, int count) {
+	jit_emit(native, "\x48\x81\xEB", 3); // sub rbx, imm32
+	jit_emit32(native, count * size);
+}
+
+// emits 'cmp [rbx], 0' followed by a jcc with a rel32 operand, and
+// records the operand so that it can be patched once the target has
+// been emitted
+void jit_jump(ByteArray *native, int size, const char *jcc,
+              IntArray *patches, int target) {
+	jit_cell_op(native, size, 0x80, 0x83, 0x3B);
+	Byte_array_insert(native, 0);
+	jit_emit(native, jcc, 2);
+	int_array_insert(patches, native->size);
+	int_array_insert(patches, target);
+	jit_emit32(native, 0);
+}
+
+// emits a JMPNZ, which spends a step of the fuel in r12 when it jumps
+// back into the loop, see fuel_refill
+void jit_loop(ByteArray *native, int size, IntArray *patches, int target) {
+	jit_cell_op(native, size, 0x80, 0x83, 0x3B); // cmp [rbx], 0
+	Byte_array_insert(native, 0);
+	jit_emit(native, "\x74\x1E", 2);         // je over the rest
+	jit_emit(native, "\x49\x83\xEC\x01", 4); // sub r12, 1
+	jit_emit(native, "\x0F\x89", 2);         // jns rel32
+	int_array_insert(patches, native->size);
+	int_array_insert(patches, target);
+	jit_emit32(native, 0);
+	jit_emit_call(native, (void *)fuel_refill);
+	jit_emit(native, "\x49\x89\xC4\xE9", 4); // mov r12, rax; jmp rel32
+	int_array_insert(patches, native->size);
+	int_array_insert(patches, target);
+	jit_emit32(native, 0);
+}
+
+#define SPECIALIZED8_SINGLE_JIT(name, fn, num) \
+	case name##_##num: fn(native, size, num); break;
+#define SPECIALIZED8_JIT_X(name, fn) \
+	case name##_X: fn(native, size, code[ip++]); break;
+#define SPECIALIZED8_JIT(name, fn)        \
+	SPECIALIZED8_SINGLE_JIT(name, fn, 1); \
+	SPECIALIZED8_SINGLE_JIT(name, fn, 2); \
+	SPECIALIZED8_SINGLE_JIT(name, fn, 3); \
+	SPECIALIZED8_SINGLE_JIT(name, fn, 4); \
+	SPECIALIZED8_SINGLE_JIT(name, fn, 5); \
+	SPECIALIZED8_SINGLE_JIT(name, fn, 6); \
+	SPECIALIZED8_SINGLE_JIT(name, fn, 7); \
+	SPECIALIZED8_SINGLE_JIT(name, fn, 8); \
+	SPECIALIZED8_JIT_X(name, fn);
+
+// translates the bytecode to x86-64 machine code for cells of the given
+// bits, appending it to native
+void jit_translate(IntArray *program, ByteArray *native, int bits, int eof) {
+	int  size = bits / 8;
+	int *code = program->values;
+	// native offset of each bytecode address
+	int *offsets = (int *)malloc(sizeof(int) * (program->size + 1));
+	// (native offset of rel32, bytecode address of target) pairs
+	IntArray patches;
+	int_array_init(&patches);
+	// push rbx; push r12; sub rsp, 8, which keeps the stack aligned for
+	// calls; mov rbx, rdi; xor r12d, r12d
+	jit_emit(native, "\x53\x41\x54\x48\x83\xEC\x08", 7);
+	jit_emit(native, "\x48\x89\xFB\x45\x31\xE4", 6);
+	for(int ip = 0; ip < program->size;) {
+		offsets[ip] = native->size;
+		switch(code[ip++]) {
+			SPECIALIZED8_JIT(INCR, jit_incr);
+			SPECIALIZED8_JIT(DECR, jit_decr);
+			SPECIALIZED8_JIT(LEFT, jit_left);
+			SPECIALIZED8_JIT(RIGHT, jit_right);
 			case INPUT:
-				print_header(f, level, &headerPrinted, fromJump);
-				print_indent(f, level);
+				jit_emit_call(native, (void *)io_read_byte);
+				if(eof != EOF_MINUS_ONE) {
+					jit_emit(native, "\x83\xF8\xFF", 3); // cmp eax, -1
+					if(eof == EOF_ZERO)
+						// jne over; xor eax, eax
+						jit_emit(native, "\x75\x02\x31\xC0", 4);
+					else {
+						// je over the store
+						jit_emit(native, "\x74", 1);
+						Byte_array_insert(native, size == 2 ? 3 : 2);
+					}
+				}
+				jit_cell_op(native, size, 0x88, 0x89, 0x03); // mov [rbx], eax
+				break;
+			case OUTPUT:
+				// the low byte of the cell
+				jit_emit(native, "\x0F\xB6\x3B", 3); // movzx edi, byte [rbx]
+				jit_emit_call(native, (void *)io_write_byte);
+				break;
+			case JMPZ:
+				jit_jump(native, size, "\x0F\x84", &patches, ip + 1 + code[ip]);
+				ip++;
+				break;
+			case JMPNZ:
+				jit_loop(native, size, &patches, ip + 1 + code[ip]);
+				ip++;
 				break;
-			case OUTPUT:
 			case RESET_CELL:
-			case START:
-			case JMPZ: isPureLoop = false;
+				jit_cell_op(native, size, 0xC6, 0xC7, 0x03); // mov [rbx], 0
+				jit_cell_imm(native, size, 0);
+				break;
+			case ADD_AT:
+				// add [rbx + disp32], imm
+				jit_cell_op(native, size, 0x80, 0x81, 0x83);
+				jit_emit32(native, code[ip] * size);
+				jit_cell_imm(native, size, code[ip + 1]);
+				ip += 2;
+				break;
+			case CLEAR_RANGE:
+				for(int i = 0; i < code[ip + 1]; i++) {
+					// mov [rbx + disp32], 0
+					jit_cell_op(native, size, 0xC6, 0xC7, 0x83);
+					jit_emit32(native, (code[ip] + i) * size);
+					jit_cell_imm(native, size, 0);
+				}
+				ip += 2;
+				break;
+			case ADD_RANGE:
+				for(int i = 0; i < code[ip + 1]; i++) {
+					// add [rbx + disp32], imm
+					jit_cell_op(native, size, 0x80, 0x81, 0x83);
+					jit_emit32(native, (code[ip + 2] + i) * size);
+					jit_cell_imm(native, size,
+					             range_value(&code[ip + 3], i, bits));
+				}
+				ip += 3 + code[ip];
+				break;
+			case MUL_LOOP:
+			case MUL_RANGE: {
+				// the targets of a range are the cells of its window
+				bool range   = code[ip - 1] == MUL_RANGE;
+				int  targets = code[ip + range];
+				int  inverse = code[ip + 1 + range];
+				// movzx eax, byte/word [rbx], or mov eax, [rbx]
+				if(size == 4)
+					jit_emit(native, "\x8B\x03", 2);
+				else
+					jit_emit(native, size == 1 ? "\x0F\xB6\x03" : "\x0F\xB7\x03",
+					         3);
+				// test eax, eax; jz rel32
+				jit_emit(native, "\x85\xC0\x0F\x84", 4);
+				int skip = native->size;
+				jit_emit32(native, 0);
+				jit_emit(native, "\x69\xC0", 2); // imul eax, eax, imm32
+				jit_emit32(native, inverse);
+				for(int i = 0; i < targets; i++) {
+					int offset = range ? code[ip + 3] + i : code[ip + 2 + i * 2];
+					int factor = range ? range_value(&code[ip + 4], i, bits)
+					                   : code[ip + 3 + i * 2];
+					if(factor == 1) {
+						// add [rbx + disp32], eax
+						jit_cell_op(native, size, 0x00, 0x01, 0x83);
+					} else if(factor == -1) {
+						// sub [rbx + disp32], eax
+						jit_cell_op(native, size, 0x28, 0x29, 0x83);
+					} else {
+						jit_emit(native, "\x69\xC8", 2); // imul ecx, eax, imm32
+						jit_emit32(native, factor);
+						// add [rbx + disp32], ecx
+						jit_cell_op(native, size, 0x00, 0x01, 0x8B);
+					}
+					jit_emit32(native, offset * size);
+				}
+				jit_cell_op(native, size, 0xC6, 0xC7, 0x03); // mov [rbx], 0
+				jit_cell_imm(native, size, 0);
+				int32_t rel = native->size - (skip + 4);
+				memcpy(&native->values[skip], &rel, 4);
+				ip += range ? 4 + code[ip] : 2 + targets * 2;
+				break;
+			}
+			case SCAN_LEFT:
+			case SCAN_RIGHT:
+				jit_emit(native, "\x48\x89\xDF\xBE", 4); // mov rdi, rbx; mov esi,
+				jit_emit32(native, code[ip++]);
+				jit_emit_call(native, code[ip - 2] == SCAN_LEFT
+				                          ? scanLefts[CELL_INDEX(bits)]
+				                          : scanRights[CELL_INDEX(bits)]);
+				jit_emit(native, "\x48\x89\xC3", 3); // mov rbx, rax
+				break;
 			case END:
-			case JMPNZ:
-				dump_changes(f, &totalChange, currentPointer - startPointer,
-				             isPureLoop, level, &headerPrinted, fromJump);
-				if(headerPrinted && *program != JMPZ)
-					print_indent(f, level -
-					                    (*program == END || *program == JMPNZ));
-				startPointer = currentPointer;
+				// add rsp, 8; pop r12; pop rbx; ret
+				jit_emit(native, "\x48\x83\xC4\x08\x41\x5C\x5B\xC3", 8);
 				break;
+			case START: break;
 		}
-#ifdef DEBUG
-		fdisassemble(f, program - source, program, level);
+	}
+	offsets[program->size] = native->size;
+	for(int i = 0; i < patches.size; i += 2) {
+		int     at     = patches.values[i];
+		int32_t rel    = offsets[patches.values[i + 1]] - (at + 4);
+		memcpy(&native->values[at], &rel, 4);
+	}
+	int_array_free(&patches);
+	free(offsets);
+}
+
+// The translated program, which any number of VMs can run at once
+typedef struct {
+	NativeCode entry;
+	size_t     size;
+} JitCode;
+
+// returns false if executable memory could not be obtained, in which
+// case the caller should use the interpreter instead
+bool jit_compile(IntArray *program, JitCode *jit, int bits, int eof) {
+	ByteArray native;
+	Byte_array_init(&native);
+	jit_translate(program, &native, bits, eof);
+	size_t size = native.size;
+	void * mem  = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED) {
+		Byte_array_free(&native);
+		return false;
+	}
+	memcpy(mem, native.values, size);
+	Byte_array_free(&native);
+	if(mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(mem, size);
+		return false;
+	}
+	jit->entry = (NativeCode)mem;
+	jit->size  = size;
+	return true;
+}
+
+void jit_free(JitCode *jit) {
+	if(jit->entry != NULL)
+		munmap((void *)jit->entry, jit->size);
+}
 #endif
-		switch(*program++) {
-			SPECIALIZED8_LINE2(INCR, &totalChange, +);
-			SPECIALIZED8_LINE2(DECR, &totalChange, -);
-			SPECIALIZED8_LINE(LEFT, currentPointer, -);
-			SPECIALIZED8_LINE(RIGHT, currentPointer, +);
-			case INPUT:
-				fprintf(f, "cell[%d] = getchar();\n",
-				        currentPointer - startPointer);
+
+void print_indent(FILE *f, int level) {
+	for(int i = 0; i < level; i++) fprintf(f, "\t");
+}
+
+void print_signaware(FILE *f, const char *lhs, int rhs) {
+	if(rhs < 0) {
+		fprintf(f, "%s -= %d;\n", lhs, -rhs);
+	} else {
+		fprintf(f, "%s += %d;\n", lhs, rhs);
+	}
+}
+
+// adds scale times the values of a window to the cells from first on,
+// in a loop the C compiler can vectorize
+void transpile_window(FILE *f, int level, int first, const int *values,
+                      int count, const char *scale) {
+	fprintf(f, "{\n");
+	print_indent(f, level + 1);
+	fprintf(f, "static const cell_t window[%d] = {", count);
+	for(int i = 0; i < count; i++)
+		fprintf(f, "%s%uu", i > 0 ? ", " : "", values[i] & cell_mask());
+	fprintf(f, "};\n");
+	print_indent(f, level + 1);
+	fprintf(f, "for(int i = 0; i < %d; i++) cell[%d + i] += %swindow[i];\n",
+	        count, first, scale);
+	print_indent(f, level);
+	fprintf(f, "}\n");
+}
+
+void transpile_block(FILE *f, NodeArray *block, int level) {
+	for(int i = 0; i < block->size; i++) {
+		Node *node = &block->values[i];
+		int   first, count, pointer, nodes, values[RANGE_MAX];
+		print_indent(f, level);
+		switch(node->kind) {
+			case IR_ADD: {
+				if((count = add_window(block, i, &first, values)) > 0) {
+					transpile_window(f, level, first, values, count, "");
+					i += count - 1;
+					break;
+				}
+				char lhs[32];
+				snprintf(lhs, sizeof(lhs), "cell[%d]", node->offset);
+				print_signaware(f, lhs, node->value);
 				break;
-			case OUTPUT: fprintf(f, "putchar(*cell);\n");
-#ifdef DEBUG
-				fprintf(f, "#ifdef DEBUG\n");
+			}
+			case IR_SET:
+				if((nodes = clear_range(block, i, &first, &count, &pointer))) {
+					fprintf(f, "memset(&cell[%d], 0, %d * sizeof(cell_t));\n",
+					        first, count);
+					if(pointer != 0) {
+						print_indent(f, level);
+						print_signaware(f, "cell", pointer);
+					}
+					i += nodes - 1;
+					break;
+				}
+				fprintf(f, "cell[%d] = %d;\n", node->offset, node->value);
+				break;
+			case IR_MOVE: print_signaware(f, "cell", node->value); break;
+			case IR_INPUT:
+				if(eofMode == EOF_MINUS_ONE)
+					fprintf(f, "cell[%d] = bf_get();\n", node->offset);
+				else if(eofMode == EOF_ZERO)
+					fprintf(f,
+					        "cell[%d] = (input = bf_get()) < 0 ? 0 : input;\n",
+					        node->offset);
+				else
+					fprintf(f, "if((input = bf_get()) >= 0) cell[%d] = input;\n",
+					        node->offset);
+				break;
+			case IR_OUTPUT:
+				fprintf(f, "bf_put(cell[%d]);\n", node->offset);
+				break;
+			case IR_TOUCH:
+				fprintf(f, "bf_touch(cell[%d]);\n", node->offset);
+				break;
+			case IR_LOOP:
+				// bf_again() is where the fuel is charged
+				fprintf(f, "if(*cell) do {\n");
+				transpile_block(f, &node->body, level + 1);
 				print_indent(f, level);
-				fprintf(f, "fflush(stdout);\n");
-				fprintf(f, "#endif\n");
-#endif
+				fprintf(f, "} while(bf_again());\n");
 				break;
-			case JMPZ:
-				isPureLoop = false;
-				program++; // ignore
-				startPointer = currentPointer = transpile_rec(
-				    f, source, &program, currentPointer, level + 1, true);
-				// reinit the array
-				Change_array_init(&totalChange);
+			case IR_MUL:
+				// the targets must not be touched when the loop does not
+				// run, they may be off the tape
+				fprintf(f, "if(*cell) {\n");
+				print_indent(f, level + 1);
+				// in unsigned, where wrapping around is defined
+				fprintf(f, "change = *cell * %uu;\n",
+				        (unsigned)mul_inverse(node->value));
+				if(add_window(&node->body, 0, &first, values) ==
+				   node->body.size) {
+					print_indent(f, level + 1);
+					transpile_window(f, level + 1, first, values,
+					                 node->body.size, "change * ");
+				} else
+					for(int j = 0; j < node->body.size; j++) {
+						print_indent(f, level + 1);
+						fprintf(f, "cell[%d] += change * %uu;\n",
+						        node->body.values[j].offset,
+						        (unsigned)node->body.values[j].value);
+					}
+				print_indent(f, level + 1);
+				fprintf(f, "*cell = 0;\n");
+				print_indent(f, level);
+				fprintf(f, "}\n");
 				break;
-			case JMPNZ:
-				program++; // ignore
-				*pgm = program;
-				if(headerPrinted)
-					fprintf(f, "}\n");
-				return currentPointer;
-			case RESET_CELL:
-				// if we just got out of a loop, *cell will already
-				// be zero
-				// print_indent(f, level);
-				// fprintf(f, "cell[%d] = 0;\n", currentPointer -
-				// startPointer);
-				if(lastOpcode != JMPNZ)
-					fprintf(f, "*cell = 0;\n");
+			case IR_SCAN:
+				fprintf(f, "cell = bf_scan_%s(cell, %d);\n",
+				        node->value > 0 ? "right" : "left", abs(node->value));
 				break;
-			case END: return currentPointer;
-			case START: return currentPointer;
 		}
-		lastOpcode = bakOpcode;
 	}
 }
 
-void transpile(const char *filename, IntArray *program) {
-	// change all the dots to underscore
-	for(char *c = (char *)filename; *c; c++) {
-		if(*c == '.') {
-			*(c + 1) = 'c';
-			*(c + 2) = 0;
+// writes the program either as a standalone C program, or as the
+// function bfvm_run(memory, bf_get, bf_put, bf_refill, bf_scan_right,
+// bf_scan_left) for the AOT engine, which charges the fuel like the
+// other engines and scans with the kernels of the bytecode engines
+void transpile_code(FILE *f, NodeArray *ir, bool standalone) {
+	fprintf(f, "#include <stdint.h>\n");
+	fprintf(f, "#include <string.h>\n\n");
+	fprintf(f, "typedef uint%d_t cell_t;\n\n", cellBits);
+	// reads a cell the C compiler can neither drop nor move other
+	// accesses across, see pass_reach
+	fprintf(f, "#define bf_touch(c) __asm__ volatile(\"\" : : \"r\"(c) : "
+	           "\"memory\")\n\n");
+	if(standalone) {
+		fprintf(f, "#include <stdio.h>\n");
+		fprintf(f, "#include <time.h>\n\n");
+		fprintf(f, "#define bf_get() getchar()\n");
+		fprintf(f, "#define bf_put(c) putchar(c)\n");
+		fprintf(f, "#define bf_again() *cell\n\n");
+		fprintf(f, "cell_t *bf_scan_right(cell_t *cell, int stride) {\n");
+		fprintf(f, "\twhile(*cell) cell += stride;\n");
+		fprintf(f, "\treturn cell;\n");
+		fprintf(f, "}\n\n");
+		fprintf(f, "cell_t *bf_scan_left(cell_t *cell, int stride) {\n");
+		fprintf(f, "\twhile(*cell) cell -= stride;\n");
+		fprintf(f, "\treturn cell;\n");
+		fprintf(f, "}\n\n");
+		fprintf(f, "cell_t memory[%d];\n\n", TAPE_CELLS);
+		fprintf(f, "int main() {\n");
+		fprintf(f, "\tclock_t start = clock();\n");
+		fprintf(f, "\tcell_t *cell = memory;\n");
+	} else {
+		// whether to go round a loop again, spending a step if so
+		fprintf(f, "#define bf_again() (*cell && "
+		           "(--fuel >= 0 || (fuel = bf_refill()) >= 0))\n\n");
+		fprintf(f, "void bfvm_run(char *memory, int (*bf_get)(void), "
+		           "void (*bf_put)(int), long (*bf_refill)(void),\n");
+		fprintf(f, "              cell_t *(*bf_scan_right)(cell_t *, int),\n");
+		fprintf(f, "              cell_t *(*bf_scan_left)(cell_t *, int)) "
+		           "{\n");
+		fprintf(f, "\tcell_t *cell = (cell_t *)memory;\n");
+		fprintf(f, "\tlong fuel = 0;\n");
+	}
+	fprintf(f, "\tcell_t change = 0;\n");
+	fprintf(f, "\tint input = 0;\n");
+	fprintf(f, "\t(void)change, (void)input;\n");
+	transpile_block(f, ir, 1);
+	if(standalone) {
+		fprintf(f, "\tprintf(\"\\nElapsed: %%fs\\n\",(double)(clock() - "
+		           "start)/CLOCKS_PER_SEC);\n");
+		fprintf(f, "\treturn 0;\n");
+	}
+	fprintf(f, "}\n");
+}
+
+// stores filename with its extension replaced by the given one in path
+void replace_extension(char *path, size_t size, const char *filename,
+                       const char *extension) {
+	const char *base = strrchr(filename, '/');
+	const char *dot  = strrchr(base != NULL ? base : filename, '.');
+	int length = dot != NULL ? dot - filename : (int)strlen(filename);
+	snprintf(path, size, "%.*s.%s", length, filename, extension);
+}
+
+// writes the program as a standalone C program next to the source
+void transpile(const char *filename, NodeArray *ir) {
+	char path[4096];
+	replace_extension(path, sizeof(path), filename, "c");
+	FILE *f = fopen(path, "wb");
+	if(f == NULL) {
+		fprintf(stderr, "Unable to write %s!\n", path);
+		return;
+	}
+	transpile_code(f, ir, true);
+	fclose(f);
+}
+
+// The AOT engine compiles the transpiled program with the system C
+// compiler into a shared object next to the source, and runs it through
+// dlopen. The object records the hashes of the source and of the build
+// of bfvm, and is rebuilt when either of them does not match.
+#define AOT_CFLAGS "-O2", "-shared", "-fPIC", "-w"
+
+typedef void (*AotFunction)(char *memory, int (*get)(void),
+                            void (*put)(int), long (*refill)(void),
+                            void *scanRight, void *scanLeft);
+
+void *aotHandle = NULL;
+
+AotFunction aot_open(const char *path, uint64_t sourceHash) {
+	aotHandle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if(aotHandle == NULL)
+		return NULL;
+	const unsigned long long *source = dlsym(aotHandle, "bfvm_source_hash");
+	const unsigned long long *build  = dlsym(aotHandle, "bfvm_build_hash");
+	void *                    run    = dlsym(aotHandle, "bfvm_run");
+	if(source == NULL || build == NULL || run == NULL ||
+	   *source != sourceHash || *build != build_hash()) {
+		dlclose(aotHandle);
+		aotHandle = NULL;
+		return NULL;
+	}
+	return (AotFunction)run;
+}
+
+// compiles the program into the shared object at path, through a
+// temporary file so that no one loads a half written object
+bool aot_build(const char *path, NodeArray *ir, uint64_t sourceHash) {
+	char source[4200], object[4200];
+	snprintf(source, sizeof(source), "%s.%d.c", path, (int)getpid());
+	snprintf(object, sizeof(object), "%s.%d", path, (int)getpid());
+	FILE *f = fopen(source, "wb");
+	if(f == NULL)
+		return false;
+	fprintf(f, "const unsigned long long bfvm_source_hash = 0x%llxULL;\n",
+	        (unsigned long long)sourceHash);
+	fprintf(f, "const unsigned long long bfvm_build_hash = 0x%llxULL;\n\n",
+	        (unsigned long long)build_hash());
+	transpile_code(f, ir, false);
+	if(fclose(f) != 0) {
+		unlink(source);
+		return false;
+	}
+	const char *cc = getenv("CC");
+	if(cc == NULL || *cc == 0)
+		cc = "cc";
+	int   status = -1;
+	pid_t pid    = fork();
+	if(pid == 0) {
+		// whatever the compiler says is not output of the program
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execlp(cc, cc, AOT_CFLAGS, "-o", object, source, (char *)NULL);
+		_exit(127);
+	}
+	if(pid > 0)
+		waitpid(pid, &status, 0);
+	unlink(source);
+	if(status != 0 || rename(object, path) != 0) {
+		unlink(object);
+		return false;
+	}
+	return true;
+}
+
+// loads the shared object of the source, building it first if it is
+// missing or stale, from the IR or, if that is NULL, from the source.
+// returns NULL if it cannot be built.
+AotFunction aot_prepare(const char *filename, NodeArray *ir,
+                        const char *source, size_t length,
+                        uint64_t sourceHash) {
+	char path[4096];
+	// dlopen searches the library path for names without a slash
+	replace_extension(path, sizeof(path) - 2, filename, "so");
+	if(strchr(path, '/') == NULL) {
+		memmove(path + 2, path, strlen(path) + 1);
+		memcpy(path, "./", 2);
+	}
+	AotFunction run = aot_open(path, sourceHash);
+	if(run != NULL)
+		return run;
+	NodeArray built;
+	bool      own = ir == NULL;
+	if(own && !build_ir(source, length, &built))
+		return NULL;
+	if(aot_build(path, own ? &built : ir, sourceHash))
+		run = aot_open(path, sourceHash);
+	if(own)
+		ir_free(&built);
+	return run;
+}
+
+// maps the whole source file read only, falling back to reading it if
+// it cannot be mapped. returns NULL if the file cannot be read.
+char *map_source(const char *filename, size_t *length, bool *mapped) {
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	char *      source;
+	*mapped = false;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		*length = st.st_size;
+		source  = (char *)mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(source != MAP_FAILED) {
+			close(fd);
+			*mapped = true;
+			return source;
+		}
+	}
+	// empty, not a regular file, or cannot be mapped
+	size_t  capacity = 1 << 16;
+	ssize_t res;
+	source  = (char *)malloc(capacity);
+	*length = 0;
+	while((res = read(fd, source + *length, capacity - *length)) > 0) {
+		*length += res;
+		if(*length == capacity)
+			source = (char *)realloc(source, capacity *= 2);
+	}
+	close(fd);
+	return source;
+}
+
+void unmap_source(char *source, size_t length, bool mapped) {
+	if(mapped)
+		munmap(source, length);
+	else
+		free(source);
+}
+
+// The bytecode cache keeps the compiled program of every source in
+// <cache dir>/<source hash>.bfc, a header followed by the bytecode as
+// it is in memory. Entries written by another build of bfvm, or that do
+// not match their checksum, are ignored and rewritten.
+#define CACHE_VERSION 1
+
+typedef struct {
+	char     magic[8];
+	uint32_t version, size; // size of the bytecode in ints
+	uint64_t sourceHash, buildHash, checksum;
+} CacheHeader;
+
+void cache_path(char *path, size_t length, const char *dir, uint64_t hash) {
+	snprintf(path, length, "%s/%016llx.bfc", dir, (unsigned long long)hash);
+}
+
+void cache_header(CacheHeader *header, uint64_t sourceHash,
+                  const IntArray *program) {
+	memset(header, 0, sizeof(CacheHeader));
+	memcpy(header->magic, "bfvmbc", 7);
+	header->version    = CACHE_VERSION;
+	header->size       = program->size;
+	header->sourceHash = sourceHash;
+	header->buildHash  = build_hash();
+	header->checksum   = hash_source((const char *)program->values,
+                                   sizeof(int) * program->size);
+}
+
+// maps the cached bytecode of the source read only, and returns NULL if
+// there is no valid entry for it. the values of the array have to be
+// released with cache_unmap.
+IntArray *cache_load(const char *dir, uint64_t sourceHash) {
+	char path[4096];
+	cache_path(path, sizeof(path), dir, sourceHash);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size <= sizeof(CacheHeader)) {
+		close(fd);
+		return NULL;
+	}
+	char *file =
+	    (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(file == MAP_FAILED)
+		return NULL;
+	IntArray program = {(int *)(file + sizeof(CacheHeader)),
+	                    (st.st_size - sizeof(CacheHeader)) / sizeof(int), 0};
+	CacheHeader expected;
+	cache_header(&expected, sourceHash, &program);
+	if(memcmp(file, &expected, sizeof(CacheHeader)) != 0 ||
+	   program.size < 1 || program.values[program.size - 1] != END) {
+		munmap(file, st.st_size);
+		return NULL;
+	}
+	IntArray *cached = (IntArray *)malloc(sizeof(IntArray));
+	*cached          = program;
+	return cached;
+}
+
+void cache_unmap(IntArray *program) {
+	munmap((char *)program->values - sizeof(CacheHeader),
+	       sizeof(CacheHeader) + sizeof(int) * program->size);
+}
+
+// writes the entry of the source, replacing the old one at once so
+// that concurrent runs never see half of it
+bool cache_store(const char *dir, uint64_t sourceHash,
+                 const IntArray *program) {
+	char path[4096], temp[4200];
+	mkdir(dir, 0777);
+	cache_path(path, sizeof(path), dir, sourceHash);
+	snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+	FILE *f = fopen(temp, "wb");
+	if(f == NULL)
+		return false;
+	CacheHeader header;
+	cache_header(&header, sourceHash, program);
+	bool written =
+	    fwrite(&header, sizeof(header), 1, f) == 1 &&
+	    fwrite(program->values, sizeof(int), program->size, f) ==
+	        (size_t)program->size;
+	if(fclose(f) != 0 || !written || rename(temp, path) != 0) {
+		unlink(temp);
+		return false;
+	}
+	return true;
+}
+
+// A checkpoint is a file holding a header, the bytecode, and from the
+// first page after them the tape. A run with --checkpoint keeps its
+// tape in a shared mapping of the file, so stopping it to resume later
+// takes syncing the tape and then the header. Runs stop that way when
+// they are told to terminate, or when they reach a time or step limit.
+// The header says the run is going on until then, so a run that
+// crashed is not resumed with a tape that moved on since.
+#define CHECKPOINT_VERSION 1
+// the exit code of a run stopped with a checkpoint
+#define CHECKPOINTED 5
+
+enum { CHECKPOINT_RUNNING, CHECKPOINT_STOPPED, CHECKPOINT_FINISHED };
+
+typedef struct {
+	char     magic[8];
+	uint32_t version, state;
+	uint64_t buildHash;
+	int32_t  cellBits, eof;
+	uint64_t size;       // of the bytecode in ints
+	uint64_t tapeOffset; // where the tape starts in the file
+	uint64_t tapeSize;   // bytes of it accessible
+	// where the program goes on
+	uint64_t ip, inputOffset;
+	int64_t  cell;
+} CheckpointHeader;
+
+typedef struct {
+	int              fd;
+	const char *     path;
+	CheckpointHeader header;
+	IntArray         code; // the bytecode run
+} Checkpoint;
+
+Checkpoint            checkpoint;
+volatile sig_atomic_t checkpointRequested;
+
+void checkpoint_request(int sig) {
+	(void)sig;
+	checkpointRequested = 1;
+}
+
+// writes the header, and makes sure it is on disk
+bool checkpoint_state(int state) {
+	checkpoint.header.state = state;
+	return pwrite(checkpoint.fd, &checkpoint.header, sizeof(CheckpointHeader),
+	              0) == sizeof(CheckpointHeader) &&
+	       fdatasync(checkpoint.fd) == 0;
+}
+
+// replaces the tape of the VM by the one in the file, and stops the run
+// with a checkpoint instead of killing it on SIGINT, SIGTERM and SIGHUP
+bool checkpoint_attach() {
+	vm->tapeSize = checkpoint.header.tapeSize;
+	if(mmap(vm->memory, TAPE_RESERVE, PROT_NONE, MAP_SHARED | MAP_FIXED,
+	        checkpoint.fd, checkpoint.header.tapeOffset) == MAP_FAILED ||
+	   mprotect(vm->memory, vm->tapeSize, PROT_READ | PROT_WRITE) != 0)
+		return false;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = checkpoint_request;
+	// input waited on when the signal comes is waited for
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	return sigaction(SIGINT, &sa, NULL) == 0 &&
+	       sigaction(SIGTERM, &sa, NULL) == 0 &&
+	       sigaction(SIGHUP, &sa, NULL) == 0;
+}
+
+// starts the checkpoint of a new run of the bytecode at path, with the
+// tape of the VM moved into it. returns false if it cannot be written.
+bool checkpoint_create(const char *path, const IntArray *code) {
+	long   page = sysconf(_SC_PAGESIZE);
+	size_t used = sizeof(CheckpointHeader) + sizeof(int) * code->size;
+	CheckpointHeader *header = &checkpoint.header;
+	memset(header, 0, sizeof(CheckpointHeader));
+	memcpy(header->magic, "bfvmck", 7);
+	header->version    = CHECKPOINT_VERSION;
+	header->buildHash  = build_hash();
+	header->cellBits   = cellBits;
+	header->eof        = eofMode;
+	header->size       = code->size;
+	header->tapeOffset = (used + page - 1) / page * page;
+	header->tapeSize   = vm->tapeSize;
+	checkpoint.path    = path;
+	checkpoint.code    = *code;
+	checkpoint.fd      = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if(checkpoint.fd < 0)
+		return false;
+	// the tape is sparse, only the cells written take room
+	return ftruncate(checkpoint.fd, header->tapeOffset + TAPE_RESERVE) == 0 &&
+	       pwrite(checkpoint.fd, code->values, sizeof(int) * code->size,
+	              sizeof(CheckpointHeader)) ==
+	           (ssize_t)(sizeof(int) * code->size) &&
+	       checkpoint_state(CHECKPOINT_RUNNING) && checkpoint_attach();
+}
+
+// reads the checkpoint at path, setting up the cells and the end of
+// input behaviour it was made with. returns false if it cannot be
+// resumed, after saying why.
+bool checkpoint_load(const char *path) {
+	CheckpointHeader *header = &checkpoint.header;
+	checkpoint.path          = path;
+	checkpoint.fd            = open(path, O_RDWR);
+	if(checkpoint.fd < 0 || pread(checkpoint.fd, header, sizeof(*header), 0) !=
+	                            sizeof(*header)) {
+		fprintf(stderr, "Unable to read the checkpoint %s!\n", path);
+		return false;
+	}
+	if(memcmp(header->magic, "bfvmck", 7) != 0 ||
+	   header->version != CHECKPOINT_VERSION ||
+	   header->buildHash != build_hash()) {
+		fprintf(stderr, "%s is not a checkpoint of this build of bfvm!\n",
+		        path);
+		return false;
+	}
+	if(header->state != CHECKPOINT_STOPPED) {
+		fprintf(stderr, "The run of %s %s!\n", path,
+		        header->state == CHECKPOINT_FINISHED
+		            ? "has finished"
+		            : "did not stop with a checkpoint");
+		return false;
+	}
+	size_t size = sizeof(int) * header->size;
+	int_array_init(&checkpoint.code);
+	int_array_resize(&checkpoint.code, header->size);
+	checkpoint.code.size = header->size;
+	if(pread(checkpoint.fd, checkpoint.code.values, size,
+	         sizeof(CheckpointHeader)) != (ssize_t)size) {
+		fprintf(stderr, "Unable to read the checkpoint %s!\n", path);
+		return false;
+	}
+	cellBits = header->cellBits;
+	eofMode  = header->eof;
+	return true;
+}
+
+// stops the run at the instruction ip and the cell index cell, so that
+// --resume goes on from there
+void checkpoint_stop(size_t ip, long cell) {
+	io_flush();
+	io_drain();
+	CheckpointHeader *header = &checkpoint.header;
+	header->ip               = ip;
+	header->cell             = cell;
+	header->inputOffset      = io_consumed();
+	header->tapeSize         = vm->tapeSize;
+	if(msync(vm->memory, vm->tapeSize, MS_SYNC) != 0 ||
+	   !checkpoint_state(CHECKPOINT_STOPPED)) {
+		fprintf(stderr, "Unable to write the checkpoint %s!\n",
+		        checkpoint.path);
+		_exit(2);
+	}
+	fprintf(stderr, "Stopped, resume with --resume=%s\n", checkpoint.path);
+	_exit(CHECKPOINTED);
+}
+
+// called with the fuel of a run with a checkpoint gone, which stops it
+// if it is asked to, or about to go past a limit
+void checkpoint_poll(const int *code, void *cell) {
+	if(checkpointRequested || vm->stepsLeft == 0 ||
+	   (vm->deadline > 0 && now() > vm->deadline))
+		checkpoint_stop(code - checkpoint.code.values,
+		                ((char *)cell - vm->memory) / (cellBits / 8));
+}
+
+// runs the bytecode of the checkpoint from where it stopped, or from the
+// start for a new one, and marks it finished at the end
+void checkpoint_run() {
+	CheckpointHeader *header = &checkpoint.header;
+	resumeCell               = header->cell;
+	// the fuel runs out often enough to notice the signals
+	vm->slice = FUEL_SLICE;
+	if(header->state != CHECKPOINT_RUNNING &&
+	   !checkpoint_state(CHECKPOINT_RUNNING)) {
+		fprintf(stderr, "Unable to write the checkpoint %s!\n",
+		        checkpoint.path);
+		return;
+	}
+	VARIANT_OF(execute_resumable, cellBits,
+	           eofMode)(checkpoint.code.values + header->ip);
+	checkpoint_state(CHECKPOINT_FINISHED);
+}
+
+enum {
+	ENGINE_INTERPRETER = BFVM_ENGINE_INTERPRETER,
+	ENGINE_COMPACT     = BFVM_ENGINE_COMPACT,
+	ENGINE_THREADED    = BFVM_ENGINE_THREADED,
+	ENGINE_SWITCH      = BFVM_ENGINE_SWITCH,
+	ENGINE_JIT         = BFVM_ENGINE_JIT,
+	ENGINE_AOT,
+	ENGINE_COUNT
+};
+
+const char *engineNames[] = {"interpreter", "compact", "threaded", "switch",
+                             "jit",         "aot"};
+
+// A program compiled for one engine. Running it only reads it, so all
+// the VMs running it share it.
+typedef struct BfvmProgram {
+	int        engine;
+	int        cellBits, eof; // what the code was compiled for
+	IntArray * code;
+	IntArray * fused; // the code with superinstructions, if not NULL
+	ByteArray *compact;
+	intptr_t * threaded;
+#ifdef BFVM_JIT
+	JitCode jit;
+#endif
+	AotFunction aot;
+} Program;
+
+// the bytecode the interpreters run
+IntArray *program_code(const Program *program) {
+	return program->fused != NULL ? program->fused : program->code;
+}
+
+// builds the form of the bytecode the engine runs, apart from the native
+// code of the AOT engine, which needs the IR
+void program_build(Program *program) {
+	// the JIT translates the plain bytecode
+	if(fusion && program->engine != ENGINE_JIT &&
+	   program->engine != ENGINE_AOT)
+		program->fused = fuse(program->code);
+	IntArray *code = program_code(program);
+	if(program->engine == ENGINE_COMPACT)
+		program->compact = compact(code);
+#ifdef BFVM_COMPUTED_GOTO
+	if(program->engine == ENGINE_THREADED)
+		program->threaded =
+		    thread_code(code, program->cellBits, program->eof);
+#endif
+#ifdef BFVM_JIT
+	if(program->engine == ENGINE_JIT)
+		jit_compile(program->code, &program->jit, program->cellBits,
+		            program->eof);
+#endif
+}
+
+// frees everything but the bytecode itself
+void program_free(Program *program) {
+	if(program->compact != NULL) {
+		Byte_array_free(program->compact);
+		free(program->compact);
+	}
+	free(program->threaded);
+	if(program->fused != NULL) {
+		int_array_free(program->fused);
+		free(program->fused);
+	}
+#ifdef BFVM_JIT
+	jit_free(&program->jit);
+#endif
+}
+
+// runs the program in the VM of the calling thread
+void run_program(const Program *program) {
+	int bits = program->cellBits, eof = program->eof;
+	switch(program->engine) {
+		case ENGINE_COMPACT:
+			VARIANT_OF(execute_compact, bits, eof)(program->compact->values);
+			break;
+#ifdef BFVM_COMPUTED_GOTO
+		case ENGINE_THREADED:
+			VARIANT_OF(execute_threaded_code, bits, eof)(program->threaded);
+			break;
+#endif
+		case ENGINE_SWITCH:
+			VARIANT_OF(execute_switch, bits, eof)(program_code(program)->values);
+			break;
+		case ENGINE_JIT:
+#ifdef BFVM_JIT
+			if(program->jit.entry != NULL) {
+				program->jit.entry(vm->memory);
+				break;
+			}
+#endif
+			// fall through - the interpreter is the fallback
+		case ENGINE_AOT:
+			if(program->aot != NULL) {
+				program->aot(vm->memory, io_read_byte, io_write_byte,
+				             fuel_refill, scanRights[CELL_INDEX(bits)],
+				             scanLefts[CELL_INDEX(bits)]);
+				break;
+			}
+			// fall through
+		default:
+			VARIANT_OF(execute_ints, bits, eof)(program_code(program)->values);
 			break;
+	}
+}
+
+// runs the program in the VM of the thread, returns 0, TAPE_ERROR if it
+// moved off the tape, or LIMIT_ERROR if it went past a limit
+int vm_run(const Program *program) {
+	sigjmp_buf escape;
+	vm->escape = &escape;
+	int status = sigsetjmp(escape, 1);
+	if(status != 0) {
+		vm->escape = NULL;
+		return status;
+	}
+	run_program(program);
+	vm->escape = NULL;
+	return 0;
+}
+
+// Batch mode runs the program once for every input file, on a pool of
+// threads taking the inputs in order. Every run gets a VM of its own,
+// and writes its output to <input>.out.
+typedef struct {
+	const Program *program;
+	char **        inputs;
+	int            count, next, failed;
+} Batch;
+
+// runs the program on one input, returns 0 or the exit code of the run
+int batch_run(const Program *program, const char *input) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s.out", input);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0) {
+		fprintf(stderr, "Unable to write %s!\n", path);
+		return 2;
+	}
+	VM *machine = vm_new(), *previous = vm;
+	if(machine == NULL) {
+		close(fd);
+		fprintf(stderr, "Unable to allocate the tape for %s!\n", input);
+		return TAPE_ERROR;
+	}
+	int status = 0;
+	vm         = machine;
+	vm_limit(machine, &runLimits);
+	if(io_open(input, fd)) {
+		status = vm_run(program);
+		io_close();
+	} else {
+		fprintf(stderr, "Unable to open input file %s!\n", input);
+		unlink(path);
+		status = 2;
+	}
+	vm = previous;
+	vm_free(machine);
+	close(fd);
+	return status;
+}
+
+void *batch_worker(void *arg) {
+	Batch *batch = (Batch *)arg;
+	int    i;
+	while((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+	      batch->count) {
+		int status = batch_run(batch->program, batch->inputs[i]);
+		if(status != 0) {
+			fprintf(stderr, "Run on %s failed!\n", batch->inputs[i]);
+			__atomic_store_n(&batch->failed, status, __ATOMIC_RELAXED);
 		}
 	}
-	FILE *f = fopen(filename, "wb");
-	fprintf(f, "#include <stdio.h>\n");
-	fprintf(f, "#include <stdint.h>\n");
-	fprintf(f, "#include <time.h>\n\n");
-	fprintf(f, "char memory[%d];\n\n", MAX_CELLS);
-	fprintf(f, "int main() {\n");
-	fprintf(f, "\tchar *cell = memory;\n");
-	fprintf(f, "\tclock_t start = clock();\n");
-	fprintf(f, "\tchar change = 0;\n");
-	fprintf(f, "\t(void)change;\n");
-	int *pgm = program->values;
-	transpile_rec(f, program->values, &pgm, 0, 1, false);
-	fprintf(f, "\tprintf(\"\\nElapsed: %%fs\\n\",(double)(clock() - "
-	           "start)/CLOCKS_PER_SEC);\n");
-	fprintf(f, "\treturn 0;\n");
-	fprintf(f, "}");
-	fclose(f);
+	return NULL;
+}
+
+// returns 0 if every run succeeded, the exit code of a failed one if not
+int batch_execute(const Program *program, char **inputs, int count,
+                  int jobs) {
+	Batch      batch   = {program, inputs, count, 0, 0};
+	pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * jobs);
+	int        started = 0;
+	while(started < jobs && started < count &&
+	      pthread_create(&threads[started], NULL, batch_worker, &batch) == 0)
+		started++;
+	// without any threads, the inputs are run right here
+	if(started == 0)
+		batch_worker(&batch);
+	for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	free(threads);
+	return batch.failed;
+}
+
+// --count-ops with an engine other than the interpreter counts the
+// instructions of the interpreter in a run of its own before the real
+// one, on the same input file, throwing the output away. stdin cannot
+// be read twice, so without an input file the count stops at the first
+// input. the real run keeps its engine, and --perf puts the branch
+// misses of that engine against the count.
+void count_run(const Program *program, const char *input) {
+	int fd      = open("/dev/null", O_WRONLY);
+	VM *machine = vm_new(), *previous = vm;
+	if(fd < 0 || machine == NULL) {
+		fprintf(stderr, "Unable to count the instructions!\n");
+		if(fd >= 0)
+			close(fd);
+		if(machine != NULL)
+			vm_free(machine);
+		return;
+	}
+	vm = machine;
+	vm_limit(machine, &runLimits);
+	// the bytecode the interpreter would run
+	IntArray *code = program->fused == NULL && fusion ? fuse(program->code)
+	                                                  : program_code(program);
+	if(io_open(input != NULL ? input : "/dev/null", fd)) {
+		machine->io.endStops = input == NULL;
+		sigjmp_buf escape;
+		machine->escape = &escape;
+		// io_end stops the run with 1
+		int stopped = sigsetjmp(escape, 1);
+		if(stopped == 0)
+			VARIANT_OF(execute_counted, program->cellBits,
+			           program->eof)(code->values);
+		else if(stopped == 1)
+			fprintf(stderr, "Counted the instructions up to the first input, "
+			                "give the input as a file to count them all!\n");
+		machine->escape = NULL;
+		io_close();
+	}
+	if(code != program_code(program)) {
+		int_array_free(code);
+		free(code);
+	}
+	vm = previous;
+	vm_free(machine);
+	close(fd);
+}
+
+// The library. Every thread keeps the VM of its last run, and gives the
+// next one a fresh tape by dropping the pages of the old one.
+pthread_once_t libraryOnce = PTHREAD_ONCE_INIT;
+pthread_key_t  libraryVM;
+bool           libraryReady;
+
+void library_vm_free(void *machine) {
+	vm_free((VM *)machine);
+}
+
+void library_init() {
+	kernels_init();
+	libraryReady = tape_init() &&
+	               pthread_key_create(&libraryVM, library_vm_free) == 0;
+}
+
+BfvmProgram *bfvm_compile(const char *source, size_t length, int engine) {
+	pthread_once(&libraryOnce, library_init);
+	if(!libraryReady || engine < 0 || engine >= ENGINE_AOT)
+		return NULL;
+	IntArray *compiled = compile(source, length);
+	if(compiled == NULL)
+		return NULL;
+	Program *program  = (Program *)calloc(1, sizeof(Program));
+	program->engine   = engine;
+	program->cellBits = cellBits;
+	program->eof      = eofMode;
+	program->code     = compiled;
+	program_build(program);
+	return program;
+}
+
+// returns the VM for a run on this thread, NULL if there is no room for
+// one. a run from inside a callback of another one gets a VM of its own,
+// which has to be freed after it.
+VM *library_vm(bool *nested) {
+	VM *machine = (VM *)pthread_getspecific(libraryVM);
+	*nested     = machine != NULL && machine->escape != NULL;
+	if(machine != NULL && !*nested) {
+		madvise(machine->memory, machine->tapeSize, MADV_DONTNEED);
+		return machine;
+	}
+	machine = vm_new();
+	if(machine != NULL && !*nested)
+		pthread_setspecific(libraryVM, machine);
+	return machine;
+}
+
+int bfvm_run_limited(const BfvmProgram *program, const BfvmIO *io,
+                     const BfvmLimits *limits) {
+	bool nested;
+	VM * machine = library_vm(&nested);
+	if(machine == NULL)
+		return BFVM_TAPE_ERROR;
+	VM *previous = vm;
+	vm           = machine;
+	vm_limit(machine, limits);
+	io_attach(io);
+	int status = vm_run(program);
+	io_close();
+	vm = previous;
+	if(nested)
+		vm_free(machine);
+	return status;
+}
+
+int bfvm_run(const BfvmProgram *program, const BfvmIO *io) {
+	return bfvm_run_limited(program, io, &(BfvmLimits){0});
+}
+
+void bfvm_free(BfvmProgram *program) {
+	program_free(program);
+	int_array_free(program->code);
+	free(program->code);
+	free(program);
+}
+
+#ifndef BFVM_LIBRARY
+// goes on with the run stopped in the checkpoint at path, which has to
+// read the same input as before from input, or stdin if it is NULL
+int resume(const char *path, const char *input, bool report) {
+	if(!report)
+		printf("Resuming %s..\n", path);
+	kernels_init();
+	if(!checkpoint_load(path))
+		return 1;
+	if(!tape_init() || (vm = vm_new()) == NULL || !checkpoint_attach()) {
+		printf("Unable to allocate the tape!\n");
+		return TAPE_ERROR;
+	}
+	if(!io_open(input, STDOUT_FILENO)) {
+		printf("Unable to open input file!\n");
+		return 2;
+	}
+	io_skip(checkpoint.header.inputOffset);
+	fflush(stdout);
+	vm_limit(vm, &runLimits);
+	clock_t start     = clock();
+	double  wallStart = now();
+	checkpoint_run();
+	io_close();
+	double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+	if(report)
+		fprintf(stderr,
+		        "{\"compile\": 0, \"cpu\": %f, \"wall\": %f, \"ops\": 0}\n",
+		        elapsed, now() - wallStart);
+	else
+		printf("Elapsed: %fs\n", elapsed);
+	int_array_free(&checkpoint.code);
+	vm_free(vm);
+	return 0;
 }
 
 int main(int argc, char *argv[]) {
-	if(argc < 2) {
-		printf("Usage: %s <bf source code> [<input data>]\n", argv[0]);
+	bool  ioStats = false, codeStats = false, report = false;
+	bool  countOps = false, emitC = false, batch = false, perf = false;
+	int   engine     = ENGINE_INTERPRETER;
+	int   jobs       = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	char *sourceFile = NULL, *inputFile = NULL;
+	// every argument after the source, batch mode runs all of them
+	char **inputs     = (char **)malloc(sizeof(char *) * argc);
+	int    inputCount = 0;
+	char *profileFile = NULL, *useProfile = NULL, *ngramFile = NULL;
+	char *checkpointFile = NULL, *resumeFile = NULL;
+	char *cacheDir = getenv("BFVM_CACHE");
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--jit") == 0)
+			engine = ENGINE_JIT;
+		else if(strncmp(argv[i], "--engine=", 9) == 0) {
+			for(engine = 0; engine < ENGINE_COUNT; engine++)
+				if(strcmp(argv[i] + 9, engineNames[engine]) == 0)
+					break;
+			if(engine == ENGINE_COUNT) {
+				printf("Unknown engine '%s'!\n", argv[i] + 9);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--io-stats") == 0)
+			ioStats = true;
+		else if(strcmp(argv[i], "--code-stats") == 0)
+			codeStats = true;
+		else if(strcmp(argv[i], "--report") == 0)
+			report = true;
+		else if(strcmp(argv[i], "--count-ops") == 0)
+			countOps = true;
+		else if(strcmp(argv[i], "--perf") == 0)
+			perf = true;
+		else if(strncmp(argv[i], "--profile=", 10) == 0) {
+			profileFile     = argv[i] + 10;
+			profile.collect = true;
+		} else if(strncmp(argv[i], "--use-profile=", 14) == 0)
+			useProfile = argv[i] + 14;
+		else if(strncmp(argv[i], "--cache=", 8) == 0)
+			cacheDir = argv[i] + 8;
+		else if(strcmp(argv[i], "--no-cache") == 0)
+			cacheDir = NULL;
+		else if(strcmp(argv[i], "--emit-c") == 0)
+			emitC = true;
+		else if(strcmp(argv[i], "--dump-ir") == 0)
+			dumpIR = true;
+		else if(strcmp(argv[i], "--pass-times") == 0)
+			passTimes = true;
+		else if(strcmp(argv[i], "--no-fuse") == 0)
+			fusion = false;
+		else if(strcmp(argv[i], "--partial") == 0)
+			partialSteps = PARTIAL_STEPS;
+		else if(strncmp(argv[i], "--partial=", 10) == 0)
+			partialSteps = atol(argv[i] + 10);
+		else if(strncmp(argv[i], "--cell=", 7) == 0) {
+			cellBits = atoi(argv[i] + 7);
+			if(cellBits != 8 && cellBits != 16 && cellBits != 32) {
+				printf("Cells are 8, 16 or 32 bits wide!\n");
+				return 1;
+			}
+		} else if(strncmp(argv[i], "--eof=", 6) == 0) {
+			for(eofMode = 0; eofMode < EOF_MODES; eofMode++)
+				if(strcmp(argv[i] + 6, eofNames[eofMode]) == 0)
+					break;
+			if(eofMode == EOF_MODES) {
+				printf("Unknown end of input behaviour '%s'!\n", argv[i] + 6);
+				return 1;
+			}
+		} else if(strncmp(argv[i], "--ngrams=", 9) == 0)
+			ngramFile = argv[i] + 9;
+		else if(strncmp(argv[i], "--checkpoint=", 13) == 0)
+			checkpointFile = argv[i] + 13;
+		else if(strncmp(argv[i], "--resume=", 9) == 0)
+			resumeFile = argv[i] + 9;
+		else if(strcmp(argv[i], "--async-output") == 0)
+			asyncOutput = true;
+		else if(strcmp(argv[i], "--batch") == 0)
+			batch = true;
+		else if(strncmp(argv[i], "--jobs=", 7) == 0)
+			jobs = atoi(argv[i] + 7);
+		else if(strncmp(argv[i], "--max-steps=", 12) == 0)
+			runLimits.steps = strtoul(argv[i] + 12, NULL, 10);
+		else if(strncmp(argv[i], "--max-output=", 13) == 0)
+			runLimits.output = strtoull(argv[i] + 13, NULL, 10);
+		else if(strncmp(argv[i], "--timeout=", 10) == 0)
+			runLimits.seconds = atof(argv[i] + 10);
+		else if(sourceFile == NULL)
+			sourceFile = argv[i];
+		else
+			inputFile = inputs[inputCount++] = argv[i];
+	}
+	if(jobs < 1)
+		jobs = 1;
+	parseThreads = jobs;
+	if(sourceFile == NULL && resumeFile == NULL) {
+		printf("Usage: %s "
+		       "[--engine=interpreter|compact|threaded|switch|jit|aot] "
+		       "[--jit] [--emit-c] "
+		       "[--async-output] [--io-stats] [--code-stats] [--report] [--count-ops] [--perf] "
+		       "[--profile=<file>] [--use-profile=<file>] "
+		       "[--cache=<dir>] [--no-cache] [--dump-ir] [--pass-times] "
+		       "[--batch] [--jobs=<threads>] [--no-fuse] [--ngrams=<file>] "
+		       "[--partial[=<steps>]] [--cell=8|16|32] [--eof=unchanged|0|-1] "
+		       "[--max-steps=<loop iterations>] [--max-output=<bytes>] "
+		       "[--timeout=<seconds>] [--checkpoint=<file>] "
+		       "<bf source code> [<input data>..]\n"
+		       "       %s --resume=<file> [<input data>]\n",
+		       argv[0], argv[0]);
 		return 0;
 	}
-	printf("Running %s..\n", argv[1]);
+	// the counters are not shared between threads
+	if(batch && (profile.collect || countOps || ngramFile != NULL)) {
+		printf("--batch cannot be combined with --profile, --count-ops or "
+		       "--ngrams!\n");
+		return 1;
+	}
+	// without --batch there is one run, and --resume has no source
+	if(!batch && (inputCount > 1 || (resumeFile != NULL && inputCount > 0))) {
+		printf("More than one input data file needs --batch!\n");
+		return 1;
+	}
+	// checkpoints are of the one run of the plain interpreter
+	if((checkpointFile != NULL || resumeFile != NULL) &&
+	   (batch || profile.collect || countOps || ngramFile != NULL)) {
+		printf("--checkpoint and --resume cannot be combined with --batch, "
+		       "--profile, --count-ops or --ngrams!\n");
+		return 1;
+	}
+	if((checkpointFile != NULL || resumeFile != NULL) &&
+	   engine != ENGINE_INTERPRETER) {
+		printf("--checkpoint and --resume only work with the interpreter "
+		       "engine!\n");
+		return 1;
+	}
+	// the input is the only file after --resume
+	if(resumeFile != NULL)
+		return resume(resumeFile, sourceFile, report);
+	// with --report, stdout carries nothing but the program output
+	if(!report)
+		printf("Running %s..\n", sourceFile);
+	kernels_init();
+	if(!tape_init() || (vm = vm_new()) == NULL) {
+		printf("Unable to allocate the tape!\n");
+		return TAPE_ERROR;
+	}
 
-	FILE *readstream = stdin;
-	if(argc > 2) {
-		readstream = fopen(argv[2], "rb");
-		if(readstream == NULL) {
-			printf("Unable to open input file!\n");
-			return 2;
-		}
+	if(!batch && !io_open(inputFile, STDOUT_FILENO)) {
+		printf("Unable to open input file!\n");
+		return 2;
 	}
 
-	FILE *f = fopen(argv[1], "rb");
-	if(f == NULL) {
+	size_t len;
+	bool   mapped;
+	char * program = map_source(sourceFile, &len, &mapped);
+	if(program == NULL) {
 		printf("Unable to open the file!\n");
 		return 1;
 	}
 
-	fseek(f, 0, SEEK_END);
-	long len = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	char *program = (char *)malloc(len + 1);
-	fread(program, len, 1, f);
-	fclose(f);
+	uint64_t sourceHash = hash_source(program, len);
+	if(useProfile != NULL && !profile_load(useProfile, sourceHash))
+		fprintf(stderr, "Ignoring profile '%s', it is not one of %s!\n",
+		        useProfile, sourceFile);
 
-	program[len] = 0;
-	// printf("%s\n", program);
-	IntArray *compiled = compile(program);
-	free(program);
+	// the code depends on the cells, the C backends also on the end of
+	// input, and the residual program of --partial on the budget
+	uint64_t compileHash = sourceHash;
+	if(cellBits != 8 || eofMode != EOF_MINUS_ONE)
+		compileHash = (compileHash ^ (uint64_t)(cellBits << 8 | eofMode)) *
+		              0x100000001b3ULL;
+	if(partialSteps > 0)
+		compileHash = (compileHash ^ (uint64_t)partialSteps) * 0x100000001b3ULL;
+
+	// profiles change the bytecode, and dumping the IR needs the passes
+	// to run, so those runs bypass the cache
+	bool useCache = cacheDir != NULL && *cacheDir && useProfile == NULL &&
+	                !profile.collect && !dumpIR && !passTimes;
+	// the C code works on the IR, which the AOT engine only builds when
+	// its shared object is stale
+	bool      needIR = emitC;
+	PerfPhase compilePerf, runPerf;
+	if(perf)
+		perf_start(&compilePerf);
+	double    compileStart = now();
+	IntArray *compiled     = NULL;
+	NodeArray ir;
+	bool      cached = false, built = false;
+	if(useCache)
+		cached = (compiled = cache_load(cacheDir, compileHash)) != NULL;
+	if(!cached || needIR)
+		built = build_ir(program, len, &ir);
+	if(!cached && built) {
+		compiled = lower(&ir);
+		if(useCache &&
+		   !cache_store(cacheDir, compileHash, compiled))
+			fprintf(stderr, "Unable to write to the cache at %s!\n",
+			        cacheDir);
+	}
 	if(compiled == NULL) {
 		printf("Error occurred while compilation!\n");
 		return 2;
 	}
+	Program code;
+	memset(&code, 0, sizeof(code));
+	code.engine   = engine;
+	code.cellBits = cellBits;
+	code.eof      = eofMode;
+	code.code     = compiled;
+	program_build(&code);
+	if(codeStats && code.compact == NULL)
+		code.compact = compact(program_code(&code));
+	if(engine == ENGINE_AOT &&
+	   (code.aot = aot_prepare(sourceFile, built ? &ir : NULL, program, len,
+	                           compileHash)) == NULL)
+		fprintf(stderr, "Unable to build the native code of %s!\n",
+		        sourceFile);
+	unmap_source(program, len, mapped);
+	double compileTime = now() - compileStart;
+	if(perf)
+		perf_stop(&compilePerf);
+	if(codeStats)
+		fprintf(stderr, "Bytecode: %zu bytes, compact: %d bytes\n",
+		        compiled->size * sizeof(int), code.compact->size);
 	// disassemble_all(compiled);
-	transpile(argv[1], compiled);
-	clock_t start = clock();
-	execute(compiled, readstream);
-	if(readstream != stdin)
-		fclose(readstream);
-	printf("Elapsed: %fs\n", (double)(clock() - start) / CLOCKS_PER_SEC);
-	int_array_free(compiled);
+	if(emitC)
+		transpile(sourceFile, &ir);
+	if(checkpointFile != NULL &&
+	   !checkpoint_create(checkpointFile, program_code(&code))) {
+		printf("Unable to write the checkpoint %s!\n", checkpointFile);
+		return 2;
+	}
+	if(countOps && engine != ENGINE_INTERPRETER)
+		count_run(&code, inputFile);
+	// anything printed so far has to go out before the program output
+	fflush(stdout);
+	if(perf)
+		perf_start(&runPerf);
+	// the clock of the time limit starts with the run
+	vm_limit(vm, &runLimits);
+	clock_t start     = clock();
+	double  wallStart = now();
+	int     status    = 0;
+	if(batch)
+		status = batch_execute(&code, inputs, inputCount, jobs);
+	else if(profile.collect)
+		execute_profiled(compiled);
+	else if(ngramFile != NULL) {
+		ngramCounts = (uint64_t *)calloc(NGRAM_OPS * NGRAM_OPS * NGRAM_OPS,
+		                                 sizeof(uint64_t));
+		VARIANT_OF(execute_ngrams, cellBits, eofMode)(compiled->values);
+	} else if(countOps && engine == ENGINE_INTERPRETER)
+		VARIANT_OF(execute_counted, cellBits,
+		           eofMode)(program_code(&code)->values);
+	else if(checkpointFile != NULL)
+		checkpoint_run();
+	else
+		run_program(&code);
+	if(!batch)
+		io_close();
+	double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+	double wall    = now() - wallStart;
+	if(perf)
+		perf_stop(&runPerf);
+	if(report)
+		fprintf(stderr,
+		        "{\"compile\": %f, \"cpu\": %f, \"wall\": %f, "
+		        "\"ops\": %llu}\n",
+		        compileTime, elapsed, wall, (unsigned long long)executedOps);
+	else {
+		printf("Compile: %fs\n", compileTime);
+		printf("Elapsed: %fs\n", elapsed);
+	}
+	if(perf) {
+		perf_print("compile", &compilePerf, 0);
+		perf_print("run", &runPerf, executedOps);
+	}
+	if(ioStats && !batch)
+		io_print_stats(wall);
+	if(profile.collect) {
+		profile_loops(compiled);
+		profile_report(compiled);
+		if(!profile_save(profileFile, sourceHash))
+			fprintf(stderr, "Unable to save the profile!\n");
+		free(profile.counts);
+		int_array_free(&profile.sourceMap);
+	}
+	if(ngramFile != NULL) {
+		if(!ngram_save(ngramFile))
+			fprintf(stderr, "Unable to save the n-grams!\n");
+		free(ngramCounts);
+	}
+	LoopProfile_array_free(&profile.loops);
+	if(aotHandle != NULL)
+		dlclose(aotHandle);
+	if(built)
+		ir_free(&ir);
+	if(cached)
+		cache_unmap(compiled);
+	else
+		int_array_free(compiled);
 	free(compiled);
+	program_free(&code);
+	vm_free(vm);
+	free(inputs);
+	return status;
 }
+#endif
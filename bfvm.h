@@ -0,0 +1,79 @@
+// libbfvm, the VM as a library. A program is compiled once and can then
+// be run any number of times, from any number of threads at once, with
+// its input and output going through the caller instead of stdin and
+// stdout. Build it with make lib.
+#ifndef BFVM_H
+#define BFVM_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BFVM_API __attribute__((visibility("default")))
+
+// the engines, in the order of --engine. the AOT engine needs a source
+// file to build next to, so it is not one of them.
+enum {
+	BFVM_ENGINE_INTERPRETER,
+	BFVM_ENGINE_COMPACT,
+	BFVM_ENGINE_THREADED,
+	BFVM_ENGINE_SWITCH,
+	BFVM_ENGINE_JIT
+};
+
+// what bfvm_run returns when the program moved off the tape
+#define BFVM_TAPE_ERROR 3
+// what bfvm_run_limited returns when the program went past a limit
+#define BFVM_LIMIT_ERROR 4
+
+typedef struct BfvmProgram BfvmProgram;
+
+// receives the next size bytes of output
+typedef void (*BfvmWrite)(void *user, const char *data, size_t size);
+// stores up to size bytes of input in buffer, and returns how many it
+// stored. 0 is the end of the input.
+typedef size_t (*BfvmRead)(void *user, char *buffer, size_t size);
+
+// The I/O of one run. The input is either all of input, or whatever read
+// hands over when input is NULL, and there is none if both are NULL.
+// Output is collected in chunks and passed to write, or dropped if it is
+// NULL. Any pending output is written before input is read.
+typedef struct {
+	const char *input;
+	size_t      inputSize;
+	BfvmRead    read;
+	BfvmWrite   write;
+	void *      user; // passed to read and write
+} BfvmIO;
+
+// Limits for a run of an untrusted program, 0 for none. A step is one
+// more iteration of a loop, as nothing else runs for long. read is not
+// interrupted at the deadline, the run stops once it returns.
+typedef struct {
+	unsigned long steps;
+	size_t        output;  // bytes
+	double        seconds; // of wall clock time
+} BfvmLimits;
+
+// compiles the source for the engine, returns NULL if it is not a valid
+// program or the engine is unknown
+BFVM_API BfvmProgram *bfvm_compile(const char *source, size_t length,
+                                   int engine);
+
+// runs the program on a fresh tape, returns 0 or BFVM_TAPE_ERROR
+BFVM_API int bfvm_run(const BfvmProgram *program, const BfvmIO *io);
+
+// runs the program like bfvm_run, stopping it with BFVM_LIMIT_ERROR once
+// it goes past one of the limits. the output is cut off at its limit.
+BFVM_API int bfvm_run_limited(const BfvmProgram *program, const BfvmIO *io,
+                              const BfvmLimits *limits);
+
+BFVM_API void bfvm_free(BfvmProgram *program);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,316 @@
+// The interpreter loop, included by bfvm.c through execute_variants.h
+// once for every encoding of the bytecode, width of the cells and end of
+// input behaviour. Before including that, define
+//   EXECUTE_NAME      the name of the function to generate
+//   CODE_TYPE         the unit of the encoded program
+//   next_op()         reads the next opcode from code
+//   next_code()       reads the next operand from code
+//   skip_code(n)      skips the next n operands
+//   TRACE()           prints the instruction at code in DEBUG builds
+// optionally
+//   COUNT_OP()        an expression evaluated on every dispatch
+//   START_CELL()      the cell to start at instead of the first one
+//   CHECKPOINT()      a statement run whenever the fuel runs out
+// and, for threaded code, which stores handler addresses instead of
+// opcodes and needs BFVM_COMPUTED_GOTO
+//   next_target()     reads the next handler address from code
+//   EXPORT_LABELS(t)  stores the handler addresses, which is all the
+//                     function does when called with NULL
+// execute_variants.h defines
+//   CELL              the type of the cells, CELL_BITS wide
+//   EOF_MODE          what input stores at the end of the input
+//   VARIANT(name)     the name of the function for them
+
+#ifndef COUNT_OP
+#define COUNT_OP() ((void)0)
+#define COUNT_OP_DEFAULT
+#endif
+#ifndef START_CELL
+#define START_CELL() ((CELL *)vm->memory)
+#define START_CELL_DEFAULT
+#endif
+#ifndef CHECKPOINT
+#define CHECKPOINT() ((void)0)
+#define CHECKPOINT_DEFAULT
+#endif
+#ifdef BFVM_COMPUTED_GOTO
+#ifndef next_target
+#define next_target() dispatchTable[next_op()]
+#define NEXT_TARGET_DEFAULT
+#endif
+#define LOOP() while(1)
+#define SWITCH() \
+	{ goto *(COUNT_OP(), next_target()); }
+#define CASE(x) LABEL_##x
+#define DISPATCH() goto *(COUNT_OP(), next_target())
+#define DISPATCH_NOW() DISPATCH()
+#else
+#define LOOP() while(1)
+#define SWITCH() switch((COUNT_OP(), next_op()))
+#define CASE(x) case x
+#define DISPATCH() break
+// from inside a nested switch
+#define DISPATCH_NOW() continue
+#endif
+
+#define SCAN_NAME(direction, bits) scan_##direction##_##bits
+#define SCAN_EXPAND(direction, bits) SCAN_NAME(direction, bits)
+// the scan kernel for the cells
+#define SCAN(direction) SCAN_EXPAND(direction, CELL_BITS)
+
+// adds times the window of count values in the next words operands to
+// the cells from target on. int operands are read where they are, any
+// others are copied out first. windows narrower than a vector are not
+// worth calling a kernel for.
+#define RANGE(target, words, count, times)                                 \
+	do {                                                                   \
+		int         copy[RANGE_MAX];                                       \
+		const CELL *values = (const CELL *)code;                           \
+		if(sizeof(CODE_TYPE) == sizeof(int))                               \
+			skip_code(words);                                              \
+		else {                                                             \
+			for(int w = 0; w < (words); w++) copy[w] = next_code();        \
+			values = (const CELL *)copy;                                   \
+		}                                                                  \
+		if((count) * sizeof(CELL) < 16) {                                  \
+			CELL *cells = (target), value;                                 \
+			for(int i = 0; i < (count); i++) {                             \
+				memcpy(&value, values + i, sizeof(CELL));                  \
+				cells[i] += value * (times);                               \
+			}                                                              \
+		} else                                                             \
+			rangeKernels[CELL_INDEX(CELL_BITS)](target, values, count,     \
+			                                    times);                    \
+	} while(0)
+
+// spends a step of the fuel of the run on a jump back into a loop
+#define CHARGE()                        \
+	do {                                \
+		if(--fuel < 0) {                \
+			CHECKPOINT();               \
+			fuel = fuel_refill();       \
+		}                               \
+	} while(0)
+
+// the next byte of input, or at the end of it, whatever EOF_MODE says
+#define READ_CELL()                                          \
+	do {                                                     \
+		int input = io_get();                                \
+		if(input != EOF || EOF_MODE == EOF_MINUS_ONE)        \
+			*cell = input;                                   \
+		else if(EOF_MODE == EOF_ZERO)                        \
+			*cell = 0;                                       \
+	} while(0)
+
+// a part of a fused instruction. op is a constant, so only its own case
+// is left after compiling, and a jump taken ends the fused instruction.
+#define STEP(op)                                                          \
+	switch(op) {                                                          \
+		case INCR_1 ... INCR_8: *cell += (op)-INCR_1 + 1; break;          \
+		case INCR_X: *cell += next_code(); break;                         \
+		case DECR_1 ... DECR_8: *cell -= (op)-DECR_1 + 1; break;          \
+		case DECR_X: *cell -= next_code(); break;                         \
+		case LEFT_1 ... LEFT_8: cell -= (op)-LEFT_1 + 1; break;           \
+		case LEFT_X: cell -= next_code(); break;                          \
+		case RIGHT_1 ... RIGHT_8: cell += (op)-RIGHT_1 + 1; break;        \
+		case RIGHT_X: cell += next_code(); break;                         \
+		case INPUT: READ_CELL(); break;                                   \
+		case OUTPUT: io_put(*cell); break;                                \
+		case RESET_CELL: *cell = 0; break;                                \
+		case ADD_AT: {                                                    \
+			int offset = next_code();                                     \
+			cell[offset] += next_code();                                  \
+			break;                                                        \
+		}                                                                 \
+		case SCAN_LEFT: cell = SCAN(left)(cell, next_code()); break;      \
+		case SCAN_RIGHT: cell = SCAN(right)(cell, next_code()); break;    \
+		case JMPZ:                                                        \
+		case JMPNZ: {                                                     \
+			int where = next_code();                                      \
+			if((*cell == 0) == ((op) == JMPZ)) {                          \
+				code += where;                                            \
+				if((op) == JMPNZ)                                         \
+					CHARGE();                                             \
+				DISPATCH_NOW();                                           \
+			}                                                             \
+			break;                                                        \
+		}                                                                 \
+		default: break;                                                   \
+	}
+
+void VARIANT(EXECUTE_NAME)(const CODE_TYPE *code) {
+#if defined(DEBUG) && defined(TRACE)
+	const CODE_TYPE *start = code;
+#endif
+#ifdef BFVM_COMPUTED_GOTO
+	void *dispatchTable[] = {&&LABEL_START,
+	                         SPECIALIZED8_GOTO(INCR),
+	                         SPECIALIZED8_GOTO(DECR),
+	                         SPECIALIZED8_GOTO(LEFT),
+	                         SPECIALIZED8_GOTO(RIGHT),
+	                         &&LABEL_INPUT,
+	                         &&LABEL_OUTPUT,
+	                         &&LABEL_JMPZ,
+	                         &&LABEL_JMPNZ,
+	                         &&LABEL_RESET_CELL,
+	                         &&LABEL_ADD_AT,
+	                         &&LABEL_MUL_LOOP,
+	                         &&LABEL_SCAN_LEFT,
+	                         &&LABEL_SCAN_RIGHT,
+	                         &&LABEL_CLEAR_RANGE,
+	                         &&LABEL_ADD_RANGE,
+	                         &&LABEL_MUL_RANGE,
+	                         &&LABEL_END,
+#define SUPER(name, a, b, c) &&LABEL_SUPER_##name,
+#include "superinstructions.h"
+#undef SUPER
+	};
+#ifdef EXPORT_LABELS
+	if(code == NULL) {
+		EXPORT_LABELS(dispatchTable);
+		return;
+	}
+#endif
+#endif
+	// after exporting the labels, which happens before there is any VM
+	CELL *cell = START_CELL();
+	long  fuel = 0;
+	LOOP() {
+#if defined(DEBUG) && defined(TRACE)
+		TRACE();
+		printf("\t\tCell: %ld\t\tValue: %u\n", (long)(cell - (CELL *)vm->memory),
+		       (unsigned)*cell);
+#endif
+		SWITCH() {
+			SPECIALIZED8_IMPL(INCR, (*cell), +);
+			SPECIALIZED8_IMPL(DECR, (*cell), -);
+			SPECIALIZED8_IMPL(LEFT, cell, -);
+			SPECIALIZED8_IMPL(RIGHT, cell, +);
+			CASE(INPUT) : {
+				READ_CELL();
+				DISPATCH();
+			}
+			CASE(OUTPUT) : {
+				io_put(*cell);
+				DISPATCH();
+			}
+			CASE(JMPZ) : {
+				int where = next_code();
+				if(*cell == 0) {
+					code += where;
+				}
+				DISPATCH();
+			}
+			CASE(JMPNZ) : {
+				int where = next_code();
+				if(*cell) {
+					code += where;
+					CHARGE();
+				}
+				DISPATCH();
+			}
+			CASE(RESET_CELL) : {
+				*cell = 0;
+				DISPATCH();
+			}
+			CASE(ADD_AT) : {
+				int offset = next_code();
+				cell[offset] += next_code();
+				DISPATCH();
+			}
+			CASE(MUL_LOOP) : {
+				int targets = next_code();
+				if(*cell == 0) {
+					skip_code(targets * 2 + 1);
+					DISPATCH();
+				}
+				// in unsigned, where wrapping around is defined
+				CELL times = *cell * (unsigned)next_code();
+				for(int i = 0; i < targets; i++) {
+					int offset = next_code();
+					cell[offset] += times * (unsigned)next_code();
+				}
+				*cell = 0;
+				DISPATCH();
+			}
+			CASE(CLEAR_RANGE) : {
+				CELL *cells = cell + next_code();
+				int   count = next_code();
+				if(count * sizeof(CELL) < 16)
+					for(int i = 0; i < count; i++) cells[i] = 0;
+				else
+					memset(cells, 0, count * sizeof(CELL));
+				DISPATCH();
+			}
+			CASE(ADD_RANGE) : {
+				int words = next_code(), count = next_code();
+				int offset = next_code();
+				RANGE(cell + offset, words, count, 1);
+				DISPATCH();
+			}
+			CASE(MUL_RANGE) : {
+				int words = next_code();
+				if(*cell == 0) {
+					skip_code(words + 3);
+					DISPATCH();
+				}
+				int  count = next_code();
+				CELL times = *cell * (unsigned)next_code();
+				int  offset = next_code();
+				RANGE(cell + offset, words, count, times);
+				*cell = 0;
+				DISPATCH();
+			}
+			CASE(SCAN_LEFT) : {
+				cell = SCAN(left)(cell, next_code());
+				DISPATCH();
+			}
+			CASE(SCAN_RIGHT) : {
+				cell = SCAN(right)(cell, next_code());
+				DISPATCH();
+			}
+#define SUPER(name, a, b, c) \
+	CASE(SUPER_##name) : {   \
+		STEP(a);             \
+		STEP(b);             \
+		STEP(c);             \
+		DISPATCH();          \
+	}
+#include "superinstructions.h"
+#undef SUPER
+			CASE(END) : { return; }
+			CASE(START) : {
+				DISPATCH(); // dummy
+			}
+		}
+	}
+}
+
+#undef LOOP
+#undef SWITCH
+#undef CASE
+#undef DISPATCH
+#undef DISPATCH_NOW
+#undef STEP
+#undef SCAN_NAME
+#undef SCAN_EXPAND
+#undef SCAN
+#undef CHARGE
+#undef READ_CELL
+#undef RANGE
+#ifdef NEXT_TARGET_DEFAULT
+#undef next_target
+#undef NEXT_TARGET_DEFAULT
+#endif
+#ifdef COUNT_OP_DEFAULT
+#undef COUNT_OP
+#undef COUNT_OP_DEFAULT
+#endif
+#ifdef START_CELL_DEFAULT
+#undef START_CELL
+#undef START_CELL_DEFAULT
+#endif
+#ifdef CHECKPOINT_DEFAULT
+#undef CHECKPOINT
+#undef CHECKPOINT_DEFAULT
+#endif
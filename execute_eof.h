@@ -0,0 +1,19 @@
+// Includes execute.h once for every end of input behaviour, for the
+// cells defined by execute_variants.h.
+#define EOF_MODE EOF_UNCHANGED
+#define EOF_NAME unchanged
+#include "execute.h"
+#undef EOF_MODE
+#undef EOF_NAME
+
+#define EOF_MODE EOF_ZERO
+#define EOF_NAME zero
+#include "execute.h"
+#undef EOF_MODE
+#undef EOF_NAME
+
+#define EOF_MODE EOF_MINUS_ONE
+#define EOF_NAME minus_one
+#include "execute.h"
+#undef EOF_MODE
+#undef EOF_NAME
@@ -0,0 +1,46 @@
+// Includes execute.h once for every width of the cells and every end of
+// input behaviour, generating EXECUTE_NAME_<bits>_<eof>, and the table
+// EXECUTE_NAME_variants of them, by CELL_INDEX(bits) and eof mode.
+// Define what execute.h needs before including it.
+#define VARIANT_NAME(name, bits, eof) name##_##bits##_##eof
+#define VARIANT_EXPAND(name, bits, eof) VARIANT_NAME(name, bits, eof)
+#define VARIANT(name) VARIANT_EXPAND(name, CELL_BITS, EOF_NAME)
+
+#define CELL uint8_t
+#define CELL_BITS 8
+#include "execute_eof.h"
+#undef CELL
+#undef CELL_BITS
+
+#define CELL uint16_t
+#define CELL_BITS 16
+#include "execute_eof.h"
+#undef CELL
+#undef CELL_BITS
+
+#define CELL uint32_t
+#define CELL_BITS 32
+#include "execute_eof.h"
+#undef CELL
+#undef CELL_BITS
+
+#define VARIANT_ROW(name, bits)                                              \
+	{                                                                        \
+		VARIANT_NAME(name, bits, unchanged), VARIANT_NAME(name, bits, zero), \
+		    VARIANT_NAME(name, bits, minus_one)                              \
+	}
+#define VARIANT_TABLE(name)                                         \
+	void (*const name##_variants[CELL_WIDTHS][EOF_MODES])(          \
+	    const CODE_TYPE *) = {VARIANT_ROW(name, 8),                 \
+	                          VARIANT_ROW(name, 16),                \
+	                          VARIANT_ROW(name, 32)}
+#define VARIANT_TABLE_EXPAND(name) VARIANT_TABLE(name)
+
+VARIANT_TABLE_EXPAND(EXECUTE_NAME);
+
+#undef VARIANT_NAME
+#undef VARIANT_EXPAND
+#undef VARIANT
+#undef VARIANT_ROW
+#undef VARIANT_TABLE
+#undef VARIANT_TABLE_EXPAND
@@ -0,0 +1,19 @@
+// Generated by superinstructions.sh, do not edit. Every line is a fused
+// instruction, SUPER(name, first, second, third), doing the instructions
+// after its name in one dispatch. Pairs end with START.
+SUPER(ADD_AT__ADD_AT, ADD_AT, ADD_AT, START)
+SUPER(JMPNZ__DECR_1, JMPNZ, DECR_1, START)
+SUPER(JMPNZ__RIGHT_1, JMPNZ, RIGHT_1, START)
+SUPER(LEFT_1__JMPNZ, LEFT_1, JMPNZ, START)
+SUPER(ADD_AT__LEFT_1, ADD_AT, LEFT_1, START)
+SUPER(LEFT_2__JMPNZ, LEFT_2, JMPNZ, START)
+SUPER(ADD_AT__LEFT_1__JMPNZ, ADD_AT, LEFT_1, JMPNZ)
+SUPER(RESET_CELL__ADD_AT, RESET_CELL, ADD_AT, START)
+SUPER(RIGHT_1__JMPZ, RIGHT_1, JMPZ, START)
+SUPER(JMPNZ__ADD_AT, JMPNZ, ADD_AT, START)
+SUPER(RIGHT_1__RESET_CELL, RIGHT_1, RESET_CELL, START)
+SUPER(SCAN_LEFT__ADD_AT, SCAN_LEFT, ADD_AT, START)
+SUPER(RIGHT_2__JMPNZ, RIGHT_2, JMPNZ, START)
+SUPER(JMPNZ__RIGHT_1__RESET_CELL, JMPNZ, RIGHT_1, RESET_CELL)
+SUPER(LEFT_X__JMPNZ, LEFT_X, JMPNZ, START)
+SUPER(ADD_AT__LEFT_2, ADD_AT, LEFT_2, START)
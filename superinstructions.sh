@@ -0,0 +1,77 @@
+#!/bin/bash
+# Records the sequences of instructions every sample program runs, and
+# writes superinstructions.h with fused instructions for the COUNT most
+# frequent ones. Every program weighs the same, whatever its number of
+# dispatches. bfvm is then rebuilt, and the dispatches each program
+# saves are reported along with the size of the binary.
+#
+#   ./superinstructions.sh [count] [programs..]
+#
+# COUNT defaults to 16. The environment may override
+#   BFVM     the binary to record with      (./bfvm)
+
+BFVM=${BFVM:-./bfvm}
+COUNT=${1:-16}
+shift
+HEADER=superinstructions.h
+# these never halt
+ENDLESS="e.b golden.b impeccable.b"
+
+programs="$*"
+if [ -z "$programs" ]; then
+	for program in *.b *.bf; do
+		case " $ENDLESS " in
+			*" $program "*) ;;
+			*) programs="$programs $program" ;;
+		esac
+	done
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+input() {
+	[ -f "$1.in" ] && echo "$1.in"
+}
+
+make -s bfvm || exit 1
+for program in $programs; do
+	"$BFVM" --report --ngrams="$tmp/$program.ngrams" "$program" \
+		$(input "$program") > /dev/null 2>&1 ||
+		echo "$program: exited with $?" >&2
+done
+
+# the share of the dispatches of every program each sequence takes,
+# summed over the programs
+cat "$tmp"/*.ngrams | awk '
+	$1 == "bfvm-ngrams" { total = $2; next }
+	total > 0 {
+		key = $2 " " $3 (NF > 3 ? " " $4 : "")
+		share[key] += $1 / total
+	}
+	END { for(key in share) printf "%.9f %s\n", share[key], key }' |
+	sort -g -r | head -n "$COUNT" > "$tmp/top"
+
+{
+	echo "// Generated by superinstructions.sh, do not edit. Every line is a fused"
+	echo "// instruction, SUPER(name, first, second, third), doing the instructions"
+	echo "// after its name in one dispatch. Pairs end with START."
+	awk '{
+		third = NF > 3 ? $4 : "START"
+		name = $2 "__" $3 (NF > 3 ? "__" $4 : "")
+		printf "SUPER(%s, %s, %s, %s)\n", name, $2, $3, third
+	}' "$tmp/top"
+} > "$HEADER"
+
+make -s bfvm || exit 1
+echo "$(grep -c '^SUPER' "$HEADER") superinstructions, bfvm is $(stat -c %s bfvm) bytes"
+for program in $programs; do
+	plain=$("$BFVM" --report --count-ops --no-fuse "$program" \
+		$(input "$program") 2>&1 > /dev/null | sed -n 's/.*"ops": \([0-9]*\).*/\1/p')
+	fused=$("$BFVM" --report --count-ops "$program" \
+		$(input "$program") 2>&1 > /dev/null | sed -n 's/.*"ops": \([0-9]*\).*/\1/p')
+	awk -v p="$program" -v a="$plain" -v b="$fused" 'BEGIN {
+		printf "%-16s %12d -> %12d dispatches (-%.1f%%)\n",
+		       p, a, b, (a > 0 ? 100 * (a - b) / a : 0)
+	}'
+done